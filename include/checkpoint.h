@@ -0,0 +1,21 @@
+// checkpoint.h - Periodic checkpoints so an interrupted check can resume
+//
+// A checkpoint holds the position in the inode or directory scan, the
+// counters and the raw checker arena (types, link counts, references,
+// parents and the block bitsets). It can only be taken at a boundary
+// where the arena is consistent: the start of an inode block in the
+// inode scan, or the start of a directory in the directory scan.
+
+// Shortest interval between checkpoints, in seconds. Each checkpoint
+// writes the arena; a timer much faster than that only stalls the scan.
+#define CKPT_MIN_SECS 1
+
+// Set by the interval timer or SIGTERM/SIGINT; the scans test it once
+// per item and call ckpt_write() when it is set.
+extern volatile sig_atomic_t ckpt_due;
+
+int ckpt_start(const char *path, double interval);
+int ckpt_resume(struct xcheck *ctx);
+void ckpt_arm(int on);
+void ckpt_write(struct xcheck *ctx, int phase, uint pos);
+void ckpt_finish(void);
@@ -0,0 +1,168 @@
+// ctx.h - Checker context: all per-image state in one arena
+
+// Check families, selected with --checks
+#define CHK_TYPES  0x01  // Inode types
+#define CHK_ADDRS  0x02  // Direct and indirect address ranges
+#define CHK_DUPS   0x04  // Blocks claimed by more than one address
+#define CHK_BITMAP 0x08  // Bitmap against block usage
+#define CHK_DIRS   0x10  // Root directory, "." / ".." format, unique names
+#define CHK_REACH  0x20  // Inodes in use against directory references
+#define CHK_REFS   0x40  // Reference counts
+#define CHK_TREE   0x80  // Directories reachable from the root, ".." matching
+#define CHK_ALL    0xff
+
+// What each family needs collected. A profile that enables none of the
+// families behind a walk or an array skips it entirely.
+#define NEED_BLOCK_WALK(c) ((c) & (CHK_ADDRS | CHK_DUPS | CHK_BITMAP))
+#define NEED_BLOCK_MAPS(c) ((c) & (CHK_DUPS | CHK_BITMAP))
+#define NEED_DIR_SCAN(c)   ((c) & (CHK_DIRS | CHK_REACH | CHK_REFS | CHK_TREE))
+#define NEED_REFS(c)       ((c) & (CHK_REACH | CHK_REFS))
+#define NEED_EDGES(c)      ((c) & (CHK_REACH | CHK_REFS | CHK_TREE))
+
+// Stand-in type for an inode with an invalid type when CHK_TYPES is off
+#define T_BAD 0xff
+
+// Slots in the table of names seen in the directory being scanned: a
+// power of two over twice the entries a directory can hold
+#define NAME_SLOTS 16384
+
+// Errors the checker reports
+enum xerr {
+    E_BAD_INODE,
+    E_BAD_DIRECT,
+    E_BAD_INDIRECT,
+    E_NO_ROOT,
+    E_DIR_FORMAT,
+    E_ADDR_FREE,
+    E_BMAP_UNUSED,
+    E_DUP_DIRECT,
+    E_DUP_INDIRECT,
+    E_INODE_UNREFERENCED,
+    E_INODE_FREE_REF,
+    E_BAD_REFCOUNT,
+    E_DIR_MULTI,
+    E_PARENT_MISMATCH,
+    E_DIR_UNREACHABLE,
+    E_DIR_LOOP,
+    E_DUP_NAME,
+    E_SCRUB_CHANGED,
+    NERRORS
+};
+
+// A directory entry found by a shard run, resolved by --merge, or a
+// subdirectory found by the directory scan for the tree check
+struct edge {
+    uint parent;            // Directory holding the entry; 0 for "." and ".."
+    uint child;             // Inode it names
+};
+
+// A name found by the directory scan (--paths, --name-index). The names
+// of one inode are chained through next, newest first.
+struct dname {
+    uint parent;            // Directory holding the entry
+    uint child;             // Inode it names
+    uint next;              // Index + 1 of the child's next name, 0 at the end
+    char name[DIRSIZ];
+    ushort pos;             // Entry's place in the directory: block * DPB + slot
+};
+
+// A name in the directory being scanned. Slots stamped with another
+// directory's inode number plus one are empty, so the table is never
+// cleared between directories; the zeroed arena stamps none.
+struct name_slot {
+    uint dir;               // Directory inode number + 1
+    char name[DIRSIZ];      // Zero-padded after the terminator
+};
+
+// What the last error was about, for the detail lines (--paths)
+struct err_detail {
+    uint inum;              // Inode the error concerns, 0 if none
+    uint block;             // Block it concerns, 0 if none
+    uint dir;               // Directory holding a bad entry, 0 if none
+    char name[DIRSIZ + 1];  // Name of that entry
+};
+
+// A bump allocator over one anonymous mapping. Resetting it for the next
+// image re-zeroes only the bytes it will use that earlier images dirtied.
+struct arena {
+    uchar *base;
+    size_t size;     // Bytes mapped
+    size_t used;     // Bytes handed out since the last reset
+    size_t dirty;    // Bytes that may be non-zero, the most any image used
+    int flags;       // IMG_POPULATE / IMG_HUGEPAGE
+};
+
+// Everything the checker knows about one image. The superblock fields
+// are kept in host order. Arrays are indexed by inode or block number.
+struct xcheck {
+    struct image *img;
+    const char *name;       // Image path, prefixed to errors in batch runs
+    int batch;
+    int checks;             // CHK_* families to run
+    int paths;              // Keep a name table (--paths, --name-index, --usage)
+
+    // Totals over every image checked with this context
+    uint64_t inodes_scanned;
+    uint64_t blocks_scanned;  // Inode, indirect, directory, bitmap and scrubbed blocks read
+    uint errors[NERRORS];
+
+    uint size;              // Blocks in the file system
+    uint ninodes;
+    uint inodestart;
+    uint bmapstart;
+    uint data_start;        // First data block (after the bitmap)
+
+    // Where a resumed check picks up (--resume); phase 0 starts afresh
+    int resume_phase;
+    uint resume_pos;
+
+    // Inodes [scan_first, scan_end) the scans cover: all of them, or one
+    // shard's range (--shard). A shard records its directory entries in
+    // edges instead of resolving them; otherwise edges holds the entries
+    // naming directories (CHK_TREE).
+    uint scan_first;
+    uint scan_end;
+    int sharded;
+    struct edge *edges;
+    size_t nedges;
+    size_t edges_cap;
+
+    struct arena arena;
+    uchar *inode_type;      // 0 for a free inode
+    short *inode_nlink;     // nlink recorded in the inode (CHK_REFS)
+    uint *inode_refs;       // Directory entries naming the inode (NEED_REFS)
+    uint *inode_parent;     // Target of a directory's "..", 0 if none (NEED_DIR_SCAN)
+    struct name_slot *dir_names;  // Names in the current directory (CHK_DIRS)
+    uint64_t *block_used;   // Bitset: block claimed by some inode (NEED_BLOCK_MAPS)
+    uint64_t *block_indirect; // Bitset: claimed through an indirect block (NEED_BLOCK_MAPS)
+    struct owner *block_owner;  // Owner of each block, in the --owner-index mapping
+    struct frag *frag;      // Layout statistics (--frag-report), or NULL
+    struct usage *usage;    // Space usage (--usage), or NULL
+    struct repair *repair;  // Fixes planned by --repair, or NULL
+
+    // Name table (--paths, --name-index): every entry other than "."
+    // and "..", and for each inode the index + 1 of its newest name
+    uint *inode_name;
+    struct dname *names;
+    size_t nnames;
+    size_t names_cap;
+    uint names_next;        // Directories below this one are fully named
+    size_t names_done;      // Names those directories hold
+    struct err_detail detail;
+};
+
+static inline int bit_test(const uint64_t *map, uint i) {
+    return (map[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bit_set(uint64_t *map, uint i) {
+    map[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+void ctx_init(struct xcheck *ctx, int flags, int checks, int paths);
+int ctx_reset(struct xcheck *ctx, struct image *img);
+int ctx_add_edge(struct xcheck *ctx, uint parent, uint child);
+int ctx_add_name(struct xcheck *ctx, uint parent, uint child, const char *name, uint pos);
+void ctx_drop_names(struct xcheck *ctx, size_t keep);
+int ctx_path(struct xcheck *ctx, const struct dname *d, char *buf, size_t n);
+void ctx_destroy(struct xcheck *ctx);
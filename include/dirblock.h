@@ -0,0 +1,19 @@
+// dirblock.h - Decode a directory block in one pass
+//
+// The directory scan needs, for every entry of a block, its inode
+// number, whether it is in use, whether that number is in range and
+// whether it is "." or "..". dir_block_scan() works all of that out for
+// the whole block at once and hands back bit masks, one bit per entry,
+// so the per-entry loop only visits the entries in use.
+
+#define DPB (BSIZE / sizeof(struct dirent))   // Directory entries per block
+
+struct dir_masks {
+    uint32_t live;           // Entry in use (inode number not 0)
+    uint32_t bad;            // Inode number at or past ninodes
+    uint32_t dot;            // Named "."
+    uint32_t dotdot;         // Named ".."
+    ushort inum[DPB];        // Inode numbers in host order
+};
+
+void dir_block_scan(const struct dirent *de, uint ninodes, struct dir_masks *m);
@@ -0,0 +1,72 @@
+// frag.h - Fragmentation and locality of one image (--frag-report)
+//
+// Gathered by the inode scan as it walks each file's block list, and by
+// a pass over the bitmap after the checks, so the report costs no reads
+// beyond the check itself.
+
+#define FRAG_BUCKETS 8       // Extents per file: 1, 2, 3-4, ..., 65+
+#define FREE_BUCKETS 16      // Free extent length: 1, 2-3, 4-7, ..., 32768+
+
+struct frag {
+    uint64_t files;          // Files and directories with data blocks
+    uint64_t empty;          // Files and directories without
+    uint64_t extents;
+    uint64_t extent_hist[FRAG_BUCKETS];
+    uint64_t steps;          // Pairs of consecutive file blocks
+    uint64_t contiguous;     // Of those, pairs on adjacent blocks
+    uint64_t seek_total;     // Sum of blocks skipped between pairs
+    uint64_t seek_max;
+    uint64_t indirect;       // Indirect blocks
+    uint64_t to_indirect;    // Sum of distances from the last direct block
+    uint64_t indirect_mapped; // Indirect blocks that map any data
+    uint64_t from_indirect;  // Sum of distances to the first block mapped
+    uint64_t free_blocks;
+    uint64_t free_extents;
+    uint64_t free_max;
+    uint64_t free_hist[FREE_BUCKETS];
+};
+
+// Where the walk of one file is
+struct frag_walk {
+    uint prev;               // Last data block, 0 before the first
+    uint extents;
+    uint indirect;           // Indirect block whose first entry is pending
+};
+
+static inline uint64_t frag_dist(uint a, uint b) {
+    return a > b ? (uint64_t)a - b : (uint64_t)b - a;
+}
+
+// Data block addr is the next block of the file
+static inline void frag_block(struct frag *f, struct frag_walk *w, uint addr) {
+    if (w->indirect) {
+        f->indirect_mapped++;
+        f->from_indirect += frag_dist(addr, w->indirect);
+        w->indirect = 0;
+    }
+    if (w->prev) {
+        uint64_t skip = frag_dist(addr, w->prev + 1);
+        f->steps++;
+        f->seek_total += skip;
+        if (skip == 0)
+            f->contiguous++;
+        else
+            w->extents++;
+        if (skip > f->seek_max)
+            f->seek_max = skip;
+    } else {
+        w->extents = 1;
+    }
+    w->prev = addr;
+}
+
+static inline void frag_indirect(struct frag *f, struct frag_walk *w, uint addr) {
+    f->indirect++;
+    if (w->prev)
+        f->to_indirect += frag_dist(addr, w->prev);
+    w->indirect = addr;
+}
+
+void frag_file(struct frag *f, const struct frag_walk *w);
+void frag_free_run(struct frag *f, uint64_t len);
+void frag_report(FILE *out, const char *name, const struct frag *f, int partial);
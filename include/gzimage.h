@@ -0,0 +1,27 @@
+// gzimage.h - Random access to a gzip-compressed image
+//
+// One streaming pass over the compressed file, at open, keeps the
+// metadata region in memory along with the indirect and directory blocks
+// the inode table names, as they go by. It also records an access point
+// every span bytes of output: where in the compressed file a deflate
+// block starts and the 32 KB of output before it, which is all inflate
+// needs to resume there. Any other block is decompressed from the
+// nearest access point at or before it.
+
+#define GZ_WINDOW    32768       // Deflate history kept at an access point
+#define GZ_CHUNK     65536       // Compressed bytes read at a time
+#define GZ_SPAN      (1 << 20)   // Least output between access points
+#define GZ_MAXPOINTS 1024        // Access points the span is sized for
+
+// What the first bytes of a file say it is
+enum img_compression {
+    IMG_RAW,
+    IMG_GZIP_DATA,
+    IMG_ZSTD_DATA
+};
+
+enum img_compression gz_probe(const char *path);
+int gz_open(struct image *img);
+const void *gz_block(struct gz *gz, uint bno);
+int gz_read(struct gz *gz, int fd, uchar *buf, uint64_t off, size_t n);
+void gz_close(struct gz *gz);
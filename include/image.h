@@ -0,0 +1,60 @@
+// image.h - Read-only access to an xv6 file system image
+
+#include <stdint.h>
+
+// Image open flags
+#define IMG_DIRECT   0x1  // Read through O_DIRECT instead of mapping the image
+#define IMG_NOADVISE 0x2  // Map without per-region madvise hints
+#define IMG_POPULATE 0x4  // Prefault the whole mapping (MAP_POPULATE)
+#define IMG_HUGEPAGE 0x8  // Ask for transparent huge pages on the mapping
+#define IMG_GZIP     0x10 // Accept a gzip-compressed image
+
+// Size of one buffer pool slot and number of slots (O_DIRECT mode)
+#define POOL_SLOT  4096
+#define POOL_SLOTS 256
+
+// Largest single read issued when loading the metadata region
+#define MAXIO (1 << 20)
+
+// A run of blocks [start, end) that holds data; everything between
+// extents is a hole and reads as zeros.
+struct extent {
+    uint start;
+    uint end;
+};
+
+// An opened image. In the default mode the whole image is mapped and
+// blocks are addressed directly. In O_DIRECT mode the metadata region
+// (boot block through the free bit map) is read up front with large
+// sequential reads, and data blocks go through a small aligned pool.
+// A gzip-compressed image is read like O_DIRECT mode, with the pool
+// filled by decompressing instead of reading.
+struct image {
+    int fd;
+    int flags;
+    uint64_t size;        // Size of the image or device (bytes)
+    uchar *map;           // Mapping of the whole image (mmap mode)
+    uchar *meta;          // Blocks [0, nmeta) (O_DIRECT mode)
+    uint nmeta;           // Number of metadata blocks
+    uint align;           // O_DIRECT buffer and offset alignment
+    uchar *pool;          // POOL_SLOTS slots of POOL_SLOT bytes
+    uint64_t *pool_tag;   // Image offset held by each slot, or ~0
+    struct extent *ext;   // Data extents from SEEK_DATA/SEEK_HOLE
+    uint next;            // Number of extents, or 0 if the image has no holes
+    struct gz *gz;        // Index of a gzip-compressed image, or NULL
+    int io_error;         // A block read failed and was handed out as zeros
+};
+
+int img_open(struct image *img, const char *path, int flags);
+const void *img_block(struct image *img, uint bno);
+int img_is_hole(struct image *img, uint bno);
+uint img_next_data(struct image *img, uint bno);
+void img_close(struct image *img);
+
+// File system access for tools that read an image without checking it
+const struct superblock *img_sb(struct image *img);
+const struct dinode *img_inode(struct image *img, uint inum);
+uint img_bmap(struct image *img, const struct dinode *dip, uint n);
+uint img_each_entry(struct image *img, const struct dinode *dip,
+                    uint (*fn)(const struct dirent *, void *), void *arg);
+uint img_lookup(struct image *img, uint dir, const char *name);
@@ -0,0 +1,7 @@
+// metrics.h - Prometheus textfile-collector export of xcheck results
+
+#include <stdint.h>
+#include <stdio.h>
+
+void metrics_image(const char *path, const struct superblock *sb, int ok);
+int metrics_write(const char *path, struct xcheck *ctx);
@@ -0,0 +1,50 @@
+// names.h - Name index: directory entries hashed by (directory, name)
+//
+// The index file is a header, a bucket array and one record per entry
+// other than "." and "..", chained per bucket. xcheck writes it from
+// its name table (--name-index); xls maps it so a path component costs
+// one hash lookup instead of a scan of the directory's blocks. Each
+// record says where in the directory its entry is, so that one block
+// read confirms the entry is still there when the index is older than
+// the image.
+
+#define NAMES_MAGIC "XNAMES2\n"
+#define NAMES_DATA  4096     // Offset of the buckets in the file
+
+struct name_rec {
+    uint parent;             // Directory holding the entry
+    uint child;              // Inode it names
+    uint next;               // Index + 1 of the next record in the bucket, 0 at the end
+    char name[DIRSIZ];
+    ushort pos;              // Entry's place in parent: block * entries per block + slot
+};
+
+struct names_header {
+    char magic[8];
+    struct superblock sb;
+    uint pad;
+    uint64_t image_size;
+    uint64_t nbuckets;       // A power of two
+    uint64_t nnames;         // Records in the file
+};
+
+// An index being built or queried
+struct name_index {
+    int fd;
+    uchar *map;
+    size_t len;
+    char *tmp;               // File being built, renamed on commit
+    const char *path;
+    struct names_header *hdr;
+    uint *bucket;            // Index + 1 of each bucket's first record
+    struct name_rec *rec;
+};
+
+int names_create(struct name_index *nx, const char *path, const struct superblock *sb, uint64_t image_size, size_t n);
+void names_add(struct name_index *nx, uint parent, uint child, const char *name, uint pos);
+int names_commit(struct name_index *nx);
+void names_abort(struct name_index *nx);
+int names_load(struct name_index *nx, const char *path);
+uint names_lookup(struct name_index *nx, uint parent, const char *name, uint *pos);
+int names_resolve(struct image *img, struct name_index *nx, const char *path, uint *inum);
+void names_unload(struct name_index *nx);
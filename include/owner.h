@@ -0,0 +1,59 @@
+// owner.h - Block ownership index: which inode holds each block
+//
+// The index file is a header followed by one record per file system
+// block, so a lookup is a single array access. xcheck fills it through a
+// shared mapping during the inode scan (--owner-index); xowner answers
+// queries against it.
+
+#define OWNER_MAGIC "XOWNER1\n"
+#define OWNER_DATA  4096     // Offset of the records in the file
+
+// Slots: 0..NDIRECT-1 direct addresses, OWN_INDIRECT the indirect
+// block itself, and OWN_ENTRY(i) entry i of the indirect block.
+#define OWN_INDIRECT NDIRECT
+#define OWN_ENTRY(i) (NDIRECT + 1 + (i))
+
+// Record flags
+#define OWN_DUP 0x1          // Also claimed by a later inode or slot
+
+struct owner {
+    uint inum;               // Owning inode, 0 if the block is not claimed
+    ushort slot;
+    ushort flags;
+};
+
+struct owner_header {
+    char magic[8];
+    struct superblock sb;
+    uint complete;           // 0 if the inode scan stopped early
+    uint64_t image_size;
+    uint64_t nblocks;        // Records in the file
+};
+
+// An index being built or queried
+struct owner_index {
+    int fd;
+    uchar *map;
+    size_t len;
+    char *tmp;               // File being built, renamed on commit
+    const char *path;
+    struct owner_header *hdr;
+    struct owner *rec;
+};
+
+// Record that slot of inode inum points at block bno. The first claim
+// wins; later ones only mark the block as shared.
+static inline void owner_note(struct owner *rec, uint bno, uint inum, uint slot) {
+    if (rec[bno].inum == 0) {
+        rec[bno].inum = inum;
+        rec[bno].slot = slot;
+    } else {
+        rec[bno].flags |= OWN_DUP;
+    }
+}
+
+int owner_create(struct owner_index *ox, const char *path, const struct superblock *sb, uint64_t image_size);
+int owner_commit(struct owner_index *ox, int complete);
+void owner_abort(struct owner_index *ox);
+int owner_load(struct owner_index *ox, const char *path);
+void owner_unload(struct owner_index *ox);
@@ -0,0 +1,17 @@
+// perf.h - Hardware performance counters for xcheck phases
+
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_PAGE_FAULTS,
+    NPERF
+};
+
+extern const char *perf_names[NPERF];
+
+int perf_open(void);
+int perf_available(enum perf_counter c);
+void perf_read(uint64_t counts[NPERF]);
+void perf_close(void);
@@ -0,0 +1,24 @@
+// progress.h - Timer-driven progress reporting for long checks
+//
+// The scans only publish their position with relaxed stores; a
+// background thread samples it on a timer and prints the phase, counts,
+// throughput and ETA. Nothing in the hot loops makes a system call.
+
+struct progress {
+    const char *image;   // Image being checked
+    int phase;           // Current enum phase
+    uint64_t pos;        // Items done in the current phase
+    uint64_t total;      // Items in the current phase
+};
+
+extern struct progress progress;
+
+// Publish the position in the current phase from a hot loop
+#define PROGRESS_POS(v) __atomic_store_n(&progress.pos, (uint64_t)(v), __ATOMIC_RELAXED)
+
+// Count one item from a hot loop; readable by the progress thread
+#define COUNT(x) __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+
+void progress_phase(const char *image, int phase, uint64_t total);
+int progress_start(struct xcheck *ctx, double interval, const char *status_file);
+void progress_stop(void);
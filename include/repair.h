@@ -0,0 +1,34 @@
+// repair.h - Rewrite the bitmap words and link counts a check found wrong
+//
+// With --repair the bitmap and reference count checks do not stop at the
+// first mismatch; each one adds a fix to a plan. If every other check
+// passes, the plan is applied as a few positioned writes of just the
+// words and fields that change, or printed with --dry-run.
+
+// The bitmap bits of blocks [base, base + 64)
+struct bitmap_fix {
+    uint base;
+    uint64_t was;
+    uint64_t now;
+};
+
+struct nlink_fix {
+    uint inum;
+    short was;
+    short now;
+};
+
+struct repair {
+    uint kinds;              // Bit (1 << enum xerr) for each kind reported
+    struct bitmap_fix *words;  // In block order
+    size_t nwords;
+    size_t words_cap;
+    struct nlink_fix *links; // In inode order
+    size_t nlinks;
+    size_t links_cap;
+};
+
+int repair_word(struct repair *rp, uint base, uint64_t was, uint64_t now);
+int repair_nlink(struct repair *rp, uint inum, short was, short now);
+int repair_apply(FILE *out, const char *path, const struct superblock *sb, struct repair *rp, int dry_run);
+void repair_free(struct repair *rp);
@@ -0,0 +1,48 @@
+// scrub.h - Block checksums for finding silent corruption
+//
+// The checksum store is a header, one CRC32C per file system block and
+// a bitset of the blocks it covers: every block that was allocated when
+// it was written (--scrub-write). A later scrub (--scrub) recomputes the
+// checksums of the blocks allocated now and reports those that differ.
+
+#define SCRUB_MAGIC "XSCRUB1\n"
+#define SCRUB_DATA  4096     // Offset of the checksums in the file
+#define SCRUB_CHUNK 2048     // Blocks a thread takes at a time
+
+struct scrub_header {
+    char magic[8];
+    struct superblock sb;
+    uint pad;
+    uint64_t image_size;
+    uint64_t nblocks;        // Checksums in the file
+    uint64_t covered;        // Blocks with a checksum
+};
+
+// A store being written or compared against
+struct scrub_store {
+    int fd;
+    uchar *map;
+    size_t len;
+    char *tmp;               // File being built, renamed on commit
+    const char *path;
+    struct scrub_header *hdr;
+    uint32_t *crc;           // Checksum of each block
+    uint64_t *covered;       // Bitset: block has a checksum
+};
+
+// What a scrub found
+struct scrub_result {
+    uint64_t checked;        // Allocated blocks read
+    uint64_t changed;        // Of those, blocks whose checksum differs
+    uint64_t added;          // Allocated now but not in the store
+    uint64_t dropped;        // In the store but free now
+    uint64_t *changed_map;   // Bitset of the changed blocks; free() it
+    double secs;
+};
+
+int scrub_create(struct scrub_store *ss, const char *path, const struct superblock *sb, uint64_t image_size);
+int scrub_commit(struct scrub_store *ss);
+void scrub_abort(struct scrub_store *ss);
+int scrub_load(struct scrub_store *ss, const char *path);
+void scrub_unload(struct scrub_store *ss);
+int scrub_run(struct image *img, struct scrub_store *ss, int write, int nthreads, struct scrub_result *res);
@@ -0,0 +1,27 @@
+// shard.h - Partial results of a sharded check and their merge
+//
+// A shard run (--shard) scans a range of inode blocks and writes what
+// the global checks need from it: the types, link counts and parents of
+// its inodes, the blocks they claim and the directory entries they
+// hold. --merge reads the shards back in inode order.
+
+// A shard file opened for merging
+struct shard {
+    const char *path;
+    FILE *f;
+    uint first, end;        // Inodes [first, end)
+    uint64_t used_pages;    // Bitset page records
+    uint64_t indirect_pages;
+    uint64_t nedges;        // Directory entries in the shard
+    uint64_t edge_off;      // File offset of the entries
+    uint64_t inodes_scanned;
+    uint64_t blocks_scanned;
+    uint errors[NERRORS];   // Errors the shard run reported
+};
+
+int shard_write(struct xcheck *ctx, const char *path);
+int shard_open(struct xcheck *ctx, struct shard *sh, const char *path);
+int shard_load(struct xcheck *ctx, struct shard *sh, uint64_t *used, uint64_t *indirect);
+int shard_seek_edges(struct shard *sh);
+size_t shard_edges(struct shard *sh, struct edge *buf, size_t max);
+void shard_close(struct shard *sh);
@@ -0,0 +1,28 @@
+// stats.h - Per-phase timing and resource usage for xcheck
+
+// Checker phases, in the order main() runs them
+enum phase {
+    PHASE_OPEN,      // Open and map the image, allocate state
+    PHASE_INODES,    // Inode scan: types, addresses, block ownership
+    PHASE_DIRS,      // Directory scan: format, references, parents
+    PHASE_LINKS,     // Reference counts and unreferenced inodes
+    PHASE_TREE,      // Directories reachable from the root
+    PHASE_BITMAP,    // Bitmap against block usage
+    PHASE_SCRUB,     // Block checksums (--scrub, --scrub-write)
+    NPHASES
+};
+
+struct phase_stats {
+    double secs;     // Wall-clock time
+    long minflt;     // Minor page faults
+    long majflt;     // Major page faults
+    uint64_t perf[NPERF];  // Counter deltas (--perf)
+};
+
+extern struct phase_stats phase_stats[NPHASES];
+extern const char *phase_names[NPHASES];
+
+void stats_enable_perf(void);
+void stats_begin(enum phase ph);
+void stats_end(enum phase ph);
+void stats_report(FILE *f);
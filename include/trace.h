@@ -0,0 +1,66 @@
+// trace.h - Static (USDT) tracepoints for xcheck
+//
+// Each probe compiles to a single nop plus an entry in the
+// .note.stapsdt ELF section, so it costs nothing until a tracer attaches
+// to it. bpftrace and perf find the probes in the binary, e.g.
+//
+//   bpftrace -e 'usdt:./src/xcheck:xcheck:dir__block { @[arg0] = count(); }'
+//   perf buildid-cache --add ./src/xcheck && perf list sdt_xcheck:*
+//
+// Probes (all arguments are 64-bit):
+//   phase__start(phase, name)        entering a checker phase
+//   phase__end(phase, name)          leaving a checker phase
+//   inode__batch(first_inum, block)  starting an inode block in the inode scan
+//   dir__block(dir_inum, block)      parsing one directory block
+//
+// The system <sys/sdt.h> is used when it is installed. Otherwise an
+// equivalent note is emitted on x86-64, and the probes compile away
+// elsewhere.
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define XTRACE_HAVE_SDT
+#endif
+#endif
+
+#if defined(XTRACE_HAVE_SDT)
+
+#define XTRACE2(name, a, b) DTRACE_PROBE2(xcheck, name, a, b)
+
+#elif defined(__x86_64__) && defined(__GNUC__)
+
+// The same note layout <sys/sdt.h> writes: probe address, base
+// address for prelink adjustment, semaphore (none), provider, name and
+// the argument locations as size@operand.
+#define XTRACE2(name, a, b)                                                 \
+    __asm__ __volatile__(                                                   \
+        "990: nop\n"                                                        \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                       \
+        ".balign 4\n"                                                       \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                  \
+        "991: .asciz \"stapsdt\"\n"                                         \
+        "992: .balign 4\n"                                                  \
+        "993: .8byte 990b\n"                                                \
+        ".8byte _.stapsdt.base\n"                                           \
+        ".8byte 0\n"                                                        \
+        ".asciz \"xcheck\"\n"                                               \
+        ".asciz \"" #name "\"\n"                                            \
+        ".asciz \"8@%0 8@%1\"\n"                                            \
+        "994: .balign 4\n"                                                  \
+        ".popsection\n"                                                     \
+        ".ifndef _.stapsdt.base\n"                                          \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        ".weak _.stapsdt.base\n"                                            \
+        ".hidden _.stapsdt.base\n"                                          \
+        "_.stapsdt.base: .space 1\n"                                        \
+        ".size _.stapsdt.base, 1\n"                                         \
+        ".popsection\n"                                                     \
+        ".endif\n"                                                          \
+        :: "nor"((unsigned long long)(a)), "nor"((unsigned long long)(b)))
+
+#else
+
+#define XTRACE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+
+#endif
@@ -0,0 +1,27 @@
+// usage.h - Space usage of one image (--usage)
+//
+// The inode scan records what each inode holds, the bitmap pass counts
+// used and free blocks, and the name table places every inode in its
+// directory, so the report needs no walk of its own.
+
+#define USAGE_TOP 10         // Largest files and subtrees listed
+
+// Index into the per-type totals: bad types, then T_DIR, T_FILE, T_DEV
+#define USAGE_TYPES 4
+
+struct usage {
+    uint *blocks;            // Blocks each inode holds, its indirect block included
+    uint64_t inodes[USAGE_TYPES];
+    uint64_t bytes[USAGE_TYPES];
+    uint64_t nblocks[USAGE_TYPES];
+    uint64_t data_used;      // Data blocks the bitmap marks in use
+    uint64_t data_free;
+    int ntop;                // Largest files, by size, largest first
+    uint top_inum[USAGE_TOP];
+    uint top_size[USAGE_TOP];
+};
+
+int usage_init(struct usage *u, uint ninodes);
+void usage_inode(struct usage *u, uint inum, int type, uint size, uint nblocks);
+void usage_report(FILE *out, struct xcheck *ctx, struct usage *u, int partial);
+void usage_free(struct usage *u);
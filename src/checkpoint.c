@@ -0,0 +1,338 @@
+// checkpoint.c - Periodic checkpoints so an interrupted check can resume
+//
+// Layout: a header padded to CKPT_DATA bytes, then the arena. Arena
+// pages that are all zero are skipped, so the file stays sparse when
+// most of the image is free. The file is written next to its
+// destination, synced and renamed into place, so a kill at any moment
+// leaves either the previous checkpoint or the new one.
+//
+// Before resuming, the superblock, the image size and two hashes are
+// compared with the image: one of the inode blocks already scanned and
+// one of the blocks reached through them, the indirect blocks of the
+// inodes scanned and the blocks of the directories scanned. Both are
+// built up as checkpoints are taken; a resume rereads those blocks once,
+// without scanning them.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "perf.h"
+#include "stats.h"
+#include "ctx.h"
+#include "checkpoint.h"
+
+#define CKPT_MAGIC "XCKPT05\n"
+#define CKPT_DATA  4096    // Offset of the arena in the file
+
+struct ckpt_header {
+    char magic[8];
+    int checks;            // CHK_* families; fixes the arena layout
+    int phase;             // PHASE_INODES or PHASE_DIRS
+    uint pos;              // Next inode to scan in that phase
+    uint pad;
+    uint64_t image_size;
+    struct superblock sb;
+    uint64_t hashed;       // Inode blocks covered by hash
+    uint64_t hash;
+    uint64_t reached;      // Scan position covered by reached_hash
+    uint64_t reached_hash;
+    uint64_t arena_used;
+    uint64_t inodes_scanned;
+    uint64_t blocks_scanned;
+    uint errors[NERRORS];
+};
+
+volatile sig_atomic_t ckpt_due;
+static volatile sig_atomic_t ckpt_stop;   // Signal that stopped the run, or 0
+static volatile sig_atomic_t ckpt_armed;
+
+static const char *ckpt_path;
+static uint64_t run_hash = 0xcbf29ce484222325ULL;  // Hash of the first run_hashed inode blocks
+static uint64_t run_hashed;
+static uint64_t reach_hash = 0xcbf29ce484222325ULL; // Hash of the blocks reached before scan_pos
+static uint64_t reach_pos;
+
+static void on_alarm(int sig) {
+    (void)sig;
+    ckpt_due = 1;
+}
+
+// Outside the scans there is nothing to save; die as if unhandled.
+static void on_stop(int sig) {
+    if (!ckpt_armed) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    ckpt_stop = sig;
+    ckpt_due = 1;
+}
+
+// Checkpoint to path every interval seconds, at least CKPT_MIN_SECS,
+// and when SIGTERM or SIGINT arrives during a scan.
+int ckpt_start(const char *path, double interval) {
+    struct sigaction sa;
+    struct itimerval it;
+
+    ckpt_path = path;
+    if (interval < CKPT_MIN_SECS)
+        interval = CKPT_MIN_SECS;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = on_alarm;
+    if (sigaction(SIGALRM, &sa, NULL) < 0)
+        return -1;
+    sa.sa_handler = on_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec = (time_t)interval;
+    it.it_value.tv_usec = (long)((interval - (time_t)interval) * 1e6);
+    it.it_interval = it.it_value;
+    return setitimer(ITIMER_REAL, &it, NULL);
+}
+
+// Only the inode and directory scans can be checkpointed. A signal that
+// arrived after the last checkpoint in a scan is delivered again now,
+// unhandled.
+void ckpt_arm(int on) {
+    ckpt_armed = on;
+    if (!on && ckpt_stop) {
+        signal(ckpt_stop, SIG_DFL);
+        raise(ckpt_stop);
+    }
+}
+
+// FNV-1a over 64-bit words, with the block number mixed in so that
+// moving data between blocks changes the hash. Holes, and addresses
+// outside the image, are skipped.
+static uint64_t hash_block(struct xcheck *ctx, uint64_t h, uint bno) {
+    if ((uint64_t)bno * BSIZE + BSIZE > ctx->img->size || img_is_hole(ctx->img, bno))
+        return h;
+    const uint64_t *w = img_block(ctx->img, bno);
+    h = (h ^ bno) * 0x100000001b3ULL;
+    for (uint i = 0; i < BSIZE / sizeof(uint64_t); i++)
+        h = (h ^ w[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static uint64_t hash_blocks(struct xcheck *ctx, uint64_t h, uint64_t from, uint64_t to) {
+    for (uint64_t b = from; b < to; b++)
+        h = hash_block(ctx, h, ctx->inodestart + b);
+    return h;
+}
+
+// Hash the blocks the scans read through inodes, for scan positions
+// [from, to): inode i's indirect block at position i, and directory
+// i's blocks at position ninodes + i. The inode blocks themselves are
+// hashed first, so their contents are what was scanned.
+static uint64_t hash_reached(struct xcheck *ctx, uint64_t h, uint64_t from, uint64_t to) {
+    for (uint64_t p = from; p < to; p++) {
+        uint inum = p < ctx->ninodes ? p : p - ctx->ninodes;
+        const struct dinode *dip = img_block(ctx->img, ctx->inodestart + inum / IPB);
+        struct dinode din = dip[inum % IPB];
+        if (din.type == 0 || (p >= ctx->ninodes && din.type != T_DIR))
+            continue;
+        if (din.addrs[NDIRECT])
+            h = hash_block(ctx, h, din.addrs[NDIRECT]);
+        if (p < ctx->ninodes)
+            continue;
+        for (uint i = 0; i < NDIRECT; i++) {
+            if (din.addrs[i])
+                h = hash_block(ctx, h, din.addrs[i]);
+        }
+        uint ind = din.addrs[NDIRECT];
+        if (ind == 0 || (uint64_t)ind * BSIZE + BSIZE > ctx->img->size || img_is_hole(ctx->img, ind))
+            continue;
+        uint addrs[NINDIRECT];
+        memcpy(addrs, img_block(ctx->img, ind), BSIZE);
+        for (uint i = 0; i < NINDIRECT; i++) {
+            if (addrs[i])
+                h = hash_block(ctx, h, addrs[i]);
+        }
+    }
+    return h;
+}
+
+// Scan position of phase at pos: inodes first, then directories
+static uint64_t scan_pos(struct xcheck *ctx, int phase, uint pos) {
+    return phase == PHASE_INODES ? pos : (uint64_t)ctx->ninodes + pos;
+}
+
+// Inode blocks fully scanned when the phase is at pos
+static uint64_t scanned_blocks(struct xcheck *ctx, int phase, uint pos) {
+    if (phase == PHASE_INODES)
+        return pos / IPB;
+    return (ctx->ninodes + IPB - 1) / IPB;
+}
+
+static int write_all(int fd, const void *buf, size_t n, off_t off) {
+    const uchar *p = buf;
+    while (n > 0) {
+        ssize_t cc = pwrite(fd, p, n, off);
+        if (cc < 0)
+            return -1;
+        p += cc;
+        n -= cc;
+        off += cc;
+    }
+    return 0;
+}
+
+static int all_zero(const uchar *p, size_t n) {
+    const uint64_t *w = (const uint64_t *)p;
+    for (size_t i = 0; i < n / sizeof(*w); i++) {
+        if (w[i])
+            return 0;
+    }
+    return 1;
+}
+
+static int save(struct xcheck *ctx, const char *tmp, int phase, uint pos) {
+    struct ckpt_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CKPT_MAGIC, sizeof(h.magic));
+    h.checks = ctx->checks;
+    h.phase = phase;
+    h.pos = pos;
+    h.image_size = ctx->img->size;
+    h.sb = *(const struct superblock *)img_block(ctx->img, 1);
+    h.hashed = run_hashed;
+    h.hash = run_hash;
+    h.reached = reach_pos;
+    h.reached_hash = reach_hash;
+    h.arena_used = ctx->arena.used;
+    h.inodes_scanned = ctx->inodes_scanned;
+    h.blocks_scanned = ctx->blocks_scanned;
+    memcpy(h.errors, ctx->errors, sizeof(h.errors));
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    int err = write_all(fd, &h, sizeof(h), 0);
+    for (size_t off = 0; !err && off < ctx->arena.used; off += CKPT_DATA) {
+        size_t n = ctx->arena.used - off < CKPT_DATA ? ctx->arena.used - off : CKPT_DATA;
+        if (!all_zero(ctx->arena.base + off, n))
+            err = write_all(fd, ctx->arena.base + off, n, CKPT_DATA + off);
+    }
+    err = err || ftruncate(fd, CKPT_DATA + ctx->arena.used) < 0 || fsync(fd) < 0;
+    err |= close(fd) < 0;
+    return err ? -1 : 0;
+}
+
+// Save the state at a scan boundary: phase is about to process pos.
+// A checkpoint that cannot be written is reported but does not stop the
+// check.
+void ckpt_write(struct xcheck *ctx, int phase, uint pos) {
+    ckpt_due = 0;
+
+    uint64_t upto = scanned_blocks(ctx, phase, pos);
+    if (upto > run_hashed) {
+        run_hash = hash_blocks(ctx, run_hash, run_hashed, upto);
+        run_hashed = upto;
+    }
+    uint64_t at = scan_pos(ctx, phase, pos);
+    if (at > reach_pos) {
+        reach_hash = hash_reached(ctx, reach_hash, reach_pos, at);
+        reach_pos = at;
+    }
+
+    size_t len = strlen(ckpt_path) + 8;
+    char *tmp = malloc(len);
+    int ok = 0;
+    if (tmp) {
+        snprintf(tmp, len, "%s.tmp", ckpt_path);
+        ok = save(ctx, tmp, phase, pos) == 0 && rename(tmp, ckpt_path) == 0;
+        if (!ok)
+            unlink(tmp);
+        free(tmp);
+    }
+    if (!ok)
+        fprintf(stderr, "warning: cannot write checkpoint %s.\n", ckpt_path);
+
+    if (ckpt_stop) {
+        if (ok)
+            fprintf(stderr, "xcheck: interrupted, checkpoint saved to %s.\n", ckpt_path);
+        exit(2);
+    }
+}
+
+// Load the checkpoint into a freshly reset context if it was taken on
+// this image with the same checks. Sets ctx->resume_phase and
+// ctx->resume_pos and returns 1 on success, 0 to start from the
+// beginning, -1 on a read error.
+int ckpt_resume(struct xcheck *ctx) {
+    struct ckpt_header h;
+
+    run_hash = reach_hash = 0xcbf29ce484222325ULL;
+    run_hashed = reach_pos = 0;
+
+    int fd = open(ckpt_path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, CKPT_MAGIC, sizeof(h.magic)) != 0) {
+        fprintf(stderr, "warning: %s is not a checkpoint, starting from the beginning.\n", ckpt_path);
+        close(fd);
+        return 0;
+    }
+
+    const struct superblock *sb = img_block(ctx->img, 1);
+    int match = h.checks == ctx->checks && h.image_size == ctx->img->size &&
+                memcmp(&h.sb, sb, sizeof(h.sb)) == 0 && h.arena_used == ctx->arena.used &&
+                (h.phase == PHASE_INODES || h.phase == PHASE_DIRS) && h.pos <= ctx->ninodes &&
+                h.hashed == scanned_blocks(ctx, h.phase, h.pos) &&
+                h.reached == scan_pos(ctx, h.phase, h.pos);
+    if (match && hash_blocks(ctx, run_hash, 0, h.hashed) != h.hash)
+        match = 0;
+    if (match && hash_reached(ctx, reach_hash, 0, h.reached) != h.reached_hash)
+        match = 0;
+    if (!match) {
+        fprintf(stderr, "warning: checkpoint %s does not match the image, starting from the beginning.\n", ckpt_path);
+        close(fd);
+        return 0;
+    }
+
+    size_t done = 0;
+    while (done < h.arena_used) {
+        ssize_t cc = pread(fd, ctx->arena.base + done, h.arena_used - done, CKPT_DATA + done);
+        if (cc <= 0) {
+            fprintf(stderr, "Error: cannot read checkpoint %s.\n", ckpt_path);
+            close(fd);
+            return -1;
+        }
+        done += cc;
+    }
+    close(fd);
+
+    run_hash = h.hash;
+    run_hashed = h.hashed;
+    reach_hash = h.reached_hash;
+    reach_pos = h.reached;
+    ctx->inodes_scanned = h.inodes_scanned;
+    ctx->blocks_scanned = h.blocks_scanned;
+    memcpy(ctx->errors, h.errors, sizeof(ctx->errors));
+    ctx->resume_phase = h.phase;
+    ctx->resume_pos = h.pos;
+    fprintf(stderr, "xcheck: resuming %s scan at inode %u.\n", phase_names[h.phase], h.pos);
+    return 1;
+}
+
+// The check ran to completion; the checkpoint is no longer needed.
+void ckpt_finish(void) {
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_REAL, &it, NULL);
+    ckpt_due = 0;
+    unlink(ckpt_path);
+}
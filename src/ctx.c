@@ -0,0 +1,205 @@
+// ctx.c - Checker context: all per-image state in one arena
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "ctx.h"
+
+#define ARENA_ALIGN 64
+
+// Make room for size bytes and hand out everything from the start
+// again, zeroed. The mapping only grows; a smaller image reuses it.
+// dirty is a high-water mark: a small image zeroes only what it uses,
+// and the larger image after it still finds the rest dirty.
+static int arena_reset(struct arena *a, size_t size) {
+    if (size < ARENA_ALIGN)
+        size = ARENA_ALIGN;
+    if (size > a->size) {
+        if (a->base)
+            munmap(a->base, a->size);
+        a->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (a->base == MAP_FAILED) {
+            a->base = NULL;
+            a->size = a->used = a->dirty = 0;
+            fprintf(stderr, "Error: out of memory.\n");
+            return -1;
+        }
+        a->size = size;
+        a->dirty = 0;
+        // Huge pages cut TLB misses on the randomly indexed arrays;
+        // populating up front takes the page faults before the scans.
+        if (a->flags & IMG_HUGEPAGE)
+            madvise(a->base, size, MADV_HUGEPAGE);
+        if (a->flags & IMG_POPULATE)
+            memset(a->base, 0, size);
+    }
+    memset(a->base, 0, a->dirty < size ? a->dirty : size);
+    a->used = 0;
+    if (size > a->dirty)
+        a->dirty = size;
+    return 0;
+}
+
+static void *arena_alloc(struct arena *a, size_t size) {
+    if (size == 0)
+        return NULL;
+    void *p = a->base + a->used;
+    a->used += (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    return p;
+}
+
+void ctx_init(struct xcheck *ctx, int flags, int checks, int paths) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->checks = checks;
+    ctx->paths = paths;
+    ctx->arena.flags = flags & (IMG_POPULATE | IMG_HUGEPAGE);
+}
+
+// Point the context at a newly opened image and lay out the state the
+// enabled checks need for the geometry in the superblock. Arrays no
+// check needs are left NULL.
+int ctx_reset(struct xcheck *ctx, struct image *img) {
+    const struct superblock *sb = img_block(img, 1);
+
+    ctx->img = img;
+    ctx->size = sb->size;
+    ctx->ninodes = sb->ninodes;
+    ctx->inodestart = sb->inodestart;
+    ctx->bmapstart = sb->bmapstart;
+    ctx->data_start = sb->bmapstart + (sb->size + BPB - 1) / BPB;
+    ctx->resume_phase = 0;
+    ctx->resume_pos = 0;
+    ctx->scan_first = 0;
+    ctx->scan_end = ctx->ninodes;
+    ctx->nedges = 0;
+    ctx->nnames = 0;
+    ctx->names_next = 0;
+    memset(&ctx->detail, 0, sizeof(ctx->detail));
+
+    int c = ctx->checks;
+    size_t n = ctx->ninodes;
+    size_t words = NEED_BLOCK_MAPS(c) ? ((size_t)ctx->size + 63) / 64 : 0;
+    size_t sizes[] = {
+        n * sizeof(*ctx->inode_type),
+        (c & CHK_REFS) ? n * sizeof(*ctx->inode_nlink) : 0,
+        NEED_REFS(c) ? n * sizeof(*ctx->inode_refs) : 0,
+        NEED_DIR_SCAN(c) ? n * sizeof(*ctx->inode_parent) : 0,
+        (c & CHK_DIRS) ? NAME_SLOTS * sizeof(*ctx->dir_names) : 0,
+        words * sizeof(uint64_t),
+        words * sizeof(uint64_t),
+        ctx->paths ? n * sizeof(*ctx->inode_name) : 0,
+    };
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        total += (sizes[i] + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (arena_reset(&ctx->arena, total) < 0)
+        return -1;
+    ctx->inode_type = arena_alloc(&ctx->arena, sizes[0]);
+    ctx->inode_nlink = arena_alloc(&ctx->arena, sizes[1]);
+    ctx->inode_refs = arena_alloc(&ctx->arena, sizes[2]);
+    ctx->inode_parent = arena_alloc(&ctx->arena, sizes[3]);
+    ctx->dir_names = arena_alloc(&ctx->arena, sizes[4]);
+    ctx->block_used = arena_alloc(&ctx->arena, sizes[5]);
+    ctx->block_indirect = arena_alloc(&ctx->arena, sizes[6]);
+    ctx->inode_name = arena_alloc(&ctx->arena, sizes[7]);
+    return 0;
+}
+
+// Record a directory entry for --merge or the tree check. The list
+// lives outside the arena because its length is not known until the
+// scan ends.
+int ctx_add_edge(struct xcheck *ctx, uint parent, uint child) {
+    if (ctx->nedges == ctx->edges_cap) {
+        size_t cap = ctx->edges_cap ? 2 * ctx->edges_cap : 4096;
+        struct edge *p = realloc(ctx->edges, cap * sizeof(*p));
+        if (p == NULL) {
+            fprintf(stderr, "Error: out of memory.\n");
+            return -1;
+        }
+        ctx->edges = p;
+        ctx->edges_cap = cap;
+    }
+    ctx->edges[ctx->nedges].parent = parent;
+    ctx->edges[ctx->nedges].child = child;
+    ctx->nedges++;
+    return 0;
+}
+
+// Record that directory parent names child. Like the edge list, the
+// table grows outside the arena.
+int ctx_add_name(struct xcheck *ctx, uint parent, uint child, const char *name, uint pos) {
+    if (ctx->nnames == ctx->names_cap) {
+        size_t cap = ctx->names_cap ? 2 * ctx->names_cap : 4096;
+        struct dname *p = realloc(ctx->names, cap * sizeof(*p));
+        if (p == NULL) {
+            fprintf(stderr, "Error: out of memory.\n");
+            return -1;
+        }
+        ctx->names = p;
+        ctx->names_cap = cap;
+    }
+    struct dname *d = &ctx->names[ctx->nnames++];
+    d->parent = parent;
+    d->child = child;
+    d->next = ctx->inode_name[child];
+    memcpy(d->name, name, DIRSIZ);
+    d->pos = pos;
+    ctx->inode_name[child] = ctx->nnames;
+    return 0;
+}
+
+// Forget every name added after the first keep, newest first so that
+// each chain gets its old head back.
+void ctx_drop_names(struct xcheck *ctx, size_t keep) {
+    while (ctx->nnames > keep) {
+        struct dname *d = &ctx->names[--ctx->nnames];
+        ctx->inode_name[d->child] = d->next;
+    }
+}
+
+// Write the path through name d into buf, following each ancestor's
+// newest name up to the root: O(depth). Returns -1 if the chain breaks
+// (a directory without a name) or loops, with what was found after a
+// "?" or "...".
+int ctx_path(struct xcheck *ctx, const struct dname *d, char *buf, size_t n) {
+    size_t pos = n - 1;
+    int r = 0;
+
+    buf[pos] = '\0';
+    for (uint depth = 0; ; depth++) {
+        size_t len = strnlen(d->name, DIRSIZ);
+        if (len + 4 > pos || depth > ctx->ninodes) {
+            r = -1;
+            memcpy(buf + pos - 3, "...", 3);
+            pos -= 3;
+            break;
+        }
+        pos -= len;
+        memcpy(buf + pos, d->name, len);
+        buf[--pos] = '/';
+        if (d->parent == ROOTINO)
+            break;
+        if (d->parent >= ctx->ninodes || ctx->inode_name[d->parent] == 0) {
+            r = -1;
+            buf[--pos] = '?';
+            break;
+        }
+        d = &ctx->names[ctx->inode_name[d->parent] - 1];
+    }
+    memmove(buf, buf + pos, n - pos);
+    return r;
+}
+
+void ctx_destroy(struct xcheck *ctx) {
+    if (ctx->arena.base)
+        munmap(ctx->arena.base, ctx->arena.size);
+    free(ctx->edges);
+    free(ctx->names);
+    memset(ctx, 0, sizeof(*ctx));
+}
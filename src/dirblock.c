@@ -0,0 +1,88 @@
+// dirblock.c - Decode a directory block in one pass
+//
+// With SSE2, eight entries are loaded as eight 16-byte vectors and
+// interleaved so that one vector holds their inode numbers and two more
+// the first four name bytes. A compare against zero, an unsigned range
+// compare and two pattern compares then classify all eight, and a pack
+// and movemask turn each result into eight mask bits. Elsewhere the
+// masks are built one entry at a time.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include "types.h"
+#include "fs.h"
+#include "dirblock.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+// One bit per 16-bit lane of a compare result
+static inline uint32_t lane_mask(__m128i v) {
+    return _mm_movemask_epi8(_mm_packs_epi16(v, v)) & 0xff;
+}
+
+void dir_block_scan(const struct dirent *de, uint ninodes, struct dir_masks *m) {
+    const __m128i *p = (const __m128i *)de;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    // Inode numbers are unsigned; flip the sign bit to compare them
+    // with the signed compare. Past 65535 inodes every number is in
+    // range.
+    const __m128i limit = _mm_xor_si128(_mm_set1_epi16((short)(ninodes > 0xffff ? 0xffff : ninodes)), sign);
+    const __m128i all_ok = _mm_set1_epi16(ninodes > 0xffff ? -1 : 0);
+    const __m128i dot = _mm_set1_epi16(0x002e);       // ".\0"
+    const __m128i dotdot = _mm_set1_epi16(0x2e2e);    // ".."
+    const __m128i low = _mm_set1_epi16(0x00ff);
+
+    m->live = m->bad = m->dot = m->dotdot = 0;
+    for (uint g = 0; g < DPB / 8; g++, p += 8) {
+        __m128i v0 = _mm_loadu_si128(p), v1 = _mm_loadu_si128(p + 1);
+        __m128i v2 = _mm_loadu_si128(p + 2), v3 = _mm_loadu_si128(p + 3);
+        __m128i v4 = _mm_loadu_si128(p + 4), v5 = _mm_loadu_si128(p + 5);
+        __m128i v6 = _mm_loadu_si128(p + 6), v7 = _mm_loadu_si128(p + 7);
+
+        // Words 0-3 of each entry, then words 0-1 and 2-3 of four
+        __m128i a01 = _mm_unpacklo_epi16(v0, v1), a23 = _mm_unpacklo_epi16(v2, v3);
+        __m128i a45 = _mm_unpacklo_epi16(v4, v5), a67 = _mm_unpacklo_epi16(v6, v7);
+        __m128i b0 = _mm_unpacklo_epi32(a01, a23), b4 = _mm_unpacklo_epi32(a45, a67);
+        __m128i c0 = _mm_unpackhi_epi32(a01, a23), c4 = _mm_unpackhi_epi32(a45, a67);
+        __m128i inum = _mm_unpacklo_epi64(b0, b4);    // Word 0: inode number
+        __m128i name0 = _mm_unpackhi_epi64(b0, b4);   // Word 1: name bytes 0-1
+        __m128i name1 = _mm_unpacklo_epi64(c0, c4);   // Word 2: name bytes 2-3
+
+        _mm_storeu_si128((__m128i *)(m->inum + 8 * g), inum);
+        __m128i in_range = _mm_or_si128(_mm_cmplt_epi16(_mm_xor_si128(inum, sign), limit), all_ok);
+        __m128i is_dot = _mm_cmpeq_epi16(name0, dot);
+        __m128i is_dotdot = _mm_and_si128(_mm_cmpeq_epi16(name0, dotdot),
+                                          _mm_cmpeq_epi16(_mm_and_si128(name1, low), zero));
+
+        m->live |= (~lane_mask(_mm_cmpeq_epi16(inum, zero)) & 0xff) << (8 * g);
+        m->bad |= (~lane_mask(in_range) & 0xff) << (8 * g);
+        m->dot |= lane_mask(is_dot) << (8 * g);
+        m->dotdot |= lane_mask(is_dotdot) << (8 * g);
+    }
+}
+
+#else
+
+void dir_block_scan(const struct dirent *de, uint ninodes, struct dir_masks *m) {
+    m->live = m->bad = m->dot = m->dotdot = 0;
+    for (uint i = 0; i < DPB; i++) {
+        const uchar *b = (const uchar *)&de[i];
+        uint inum = b[0] | (uint)b[1] << 8;
+        uint32_t bit = (uint32_t)1 << i;
+
+        m->inum[i] = inum;
+        if (inum != 0)
+            m->live |= bit;
+        if (inum >= ninodes)
+            m->bad |= bit;
+        if (de[i].name[0] == '.' && de[i].name[1] == '\0')
+            m->dot |= bit;
+        if (de[i].name[0] == '.' && de[i].name[1] == '.' && de[i].name[2] == '\0')
+            m->dotdot |= bit;
+    }
+}
+
+#endif
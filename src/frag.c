@@ -0,0 +1,80 @@
+// frag.c - Fragmentation and locality of one image (--frag-report)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h"
+#include "frag.h"
+
+// Bucket of n in a histogram of powers of two, the last one open
+static int log2_bucket(uint64_t n, int nbuckets) {
+    int b = 0;
+    while (n > 1 && b < nbuckets - 1) {
+        n >>= 1;
+        b++;
+    }
+    return b;
+}
+
+// The walk of a file or directory is over
+void frag_file(struct frag *f, const struct frag_walk *w) {
+    if (w->extents == 0) {
+        f->empty++;
+        return;
+    }
+    f->files++;
+    f->extents += w->extents;
+    // 1, 2, 3-4, 5-8, ...
+    f->extent_hist[log2_bucket(2 * (uint64_t)w->extents - 1, FRAG_BUCKETS)]++;
+}
+
+// The bitmap has a run of len free data blocks
+void frag_free_run(struct frag *f, uint64_t len) {
+    f->free_blocks += len;
+    f->free_extents++;
+    if (len > f->free_max)
+        f->free_max = len;
+    f->free_hist[log2_bucket(len, FREE_BUCKETS)]++;
+}
+
+static double ratio(uint64_t a, uint64_t b) {
+    return b ? (double)a / b : 0;
+}
+
+static void print_hist(FILE *out, const char *unit, const uint64_t *hist, int n, int from_one) {
+    for (int b = 0; b < n; b++) {
+        uint64_t lo = from_one && b > 0 ? ((uint64_t)1 << (b - 1)) + 1 : (uint64_t)1 << b;
+        uint64_t hi = from_one ? (uint64_t)1 << b : ((uint64_t)1 << (b + 1)) - 1;
+        char range[48];
+
+        if (hist[b] == 0)
+            continue;
+        if (b == n - 1)
+            snprintf(range, sizeof(range), "%llu+", (unsigned long long)lo);
+        else if (lo == hi)
+            snprintf(range, sizeof(range), "%llu", (unsigned long long)lo);
+        else
+            snprintf(range, sizeof(range), "%llu-%llu", (unsigned long long)lo, (unsigned long long)hi);
+        fprintf(out, "  %12s %-7s %12llu\n", range, unit, (unsigned long long)hist[b]);
+    }
+}
+
+// Print the report for image name; partial if the check stopped before
+// the scans finished
+void frag_report(FILE *out, const char *name, const struct frag *f, int partial) {
+    fprintf(out, "fragmentation of %s%s\n", name, partial ? " (partial: the check stopped at an error)" : "");
+    fprintf(out, "files and directories: %llu with data, %llu empty, %.2f extents each\n",
+            (unsigned long long)f->files, (unsigned long long)f->empty, ratio(f->extents, f->files));
+    print_hist(out, "extents", f->extent_hist, FRAG_BUCKETS, 1);
+    fprintf(out, "block steps: %llu, %.1f%% contiguous, average seek %.1f blocks, longest %llu\n",
+            (unsigned long long)f->steps, 100 * ratio(f->contiguous, f->steps),
+            ratio(f->seek_total, f->steps), (unsigned long long)f->seek_max);
+    fprintf(out, "indirect blocks: %llu, average %.1f blocks from the last direct block, "
+                 "%.1f to the first block mapped\n",
+            (unsigned long long)f->indirect, ratio(f->to_indirect, f->indirect),
+            ratio(f->from_indirect, f->indirect_mapped));
+    fprintf(out, "free space: %llu blocks in %llu extents, largest %llu, average %.1f\n",
+            (unsigned long long)f->free_blocks, (unsigned long long)f->free_extents,
+            (unsigned long long)f->free_max, ratio(f->free_blocks, f->free_extents));
+    print_hist(out, "blocks", f->free_hist, FREE_BUCKETS, 0);
+}
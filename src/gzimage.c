@@ -0,0 +1,483 @@
+// gzimage.c - Random access to a gzip-compressed image
+//
+// The access points follow zran.c from the zlib examples: inflate with
+// Z_BLOCK stops at each deflate block boundary, where the bit offset in
+// the compressed stream and the last 32 KB of output are enough to start
+// a raw inflate later. Concatenated gzip members are one image.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "gzimage.h"
+
+// Deflate expands at most about 1032:1, which bounds how large the image
+// behind a compressed file can claim to be.
+#define GZ_MAXRATIO 1032
+
+// Where inflate can start without what came before
+struct gz_point {
+    uint64_t out;             // Offset in the image
+    uint64_t in;              // Offset in the compressed file of the first whole byte
+    int bits;                 // Bits of the byte before in still to be read (0-7)
+    uchar window[GZ_WINDOW];  // The GZ_WINDOW bytes of image before out
+};
+
+struct gz {
+    struct gz_point *points;  // Ascending by out
+    uint npoints;
+    uint cap;
+    uint64_t span;            // Output between access points
+    uint *kept;               // Blocks kept by the pass, ascending
+    uchar *kept_data;         // BSIZE bytes for each kept block
+    size_t nkept;
+    size_t kept_cap;
+
+    // Decompression left where the last gz_read() stopped, so reads that
+    // move forward through the image continue instead of starting over
+    z_stream strm;
+    int live;                 // strm holds a stream
+    int raw;                  // strm is raw deflate, started at a point
+    int fresh;                // strm was reset for a member and has no output yet
+    uint trailer;             // Bytes of a member trailer still to skip
+    uint64_t out;             // Image offset strm has produced up to
+    uint64_t in_off;          // Compressed offset of the next read
+    uchar *in;                // GZ_CHUNK bytes of compressed input
+    uchar *scratch;           // Output that is skipped over
+};
+
+// State of the pass at open
+struct gz_pass {
+    struct image *img;
+    struct gz *gz;
+    uint64_t max_blocks;      // Blocks the compressed size can hold
+    uchar head[2 * BSIZE];    // Boot block and superblock
+    uint64_t nblocks;         // Blocks in the file system, once known
+    uint64_t *wanted;         // Blocks to keep
+    uint64_t *dirind;         // Of those, indirect blocks of directories
+};
+
+#define BIT_SET(map, b) ((map)[(b) / 64] |= (uint64_t)1 << ((b) % 64))
+#define BIT_TEST(map, b) ((map)[(b) / 64] >> ((b) % 64) & 1)
+
+// What the first bytes of path say it holds. Anything that cannot be
+// read is left for img_open() to report.
+enum img_compression gz_probe(const char *path) {
+    uchar magic[4];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return IMG_RAW;
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return IMG_GZIP_DATA;
+    if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return IMG_ZSTD_DATA;
+    return IMG_RAW;
+}
+
+static int gz_nomem(void) {
+    fprintf(stderr, "Error: out of memory.\n");
+    return -1;
+}
+
+// Record an access point at image offset out. window is the circular
+// output buffer and out % GZ_WINDOW is where the next byte would go.
+static int gz_add_point(struct gz *gz, int bits, uint64_t in, uint64_t out, const uchar *window) {
+    if (gz->npoints == gz->cap) {
+        uint cap = gz->cap ? 2 * gz->cap : 64;
+        struct gz_point *p = realloc(gz->points, (size_t)cap * sizeof(*p));
+        if (p == NULL)
+            return gz_nomem();
+        gz->points = p;
+        gz->cap = cap;
+    }
+    struct gz_point *pt = &gz->points[gz->npoints++];
+    uint pos = out % GZ_WINDOW;
+    pt->out = out;
+    pt->in = in;
+    pt->bits = bits;
+    if (out < GZ_WINDOW) {
+        memset(pt->window, 0, GZ_WINDOW - pos);
+        memcpy(pt->window + GZ_WINDOW - pos, window, pos);
+    } else {
+        memcpy(pt->window, window + pos, GZ_WINDOW - pos);
+        memcpy(pt->window + GZ_WINDOW - pos, window, pos);
+    }
+    // A superblock that understates the image would otherwise let the
+    // index grow without bound
+    if (gz->npoints % GZ_MAXPOINTS == 0)
+        gz->span *= 2;
+    return 0;
+}
+
+static int gz_keep(struct gz *gz, uint bno, const uchar *data) {
+    if (gz->nkept == gz->kept_cap) {
+        size_t cap = gz->kept_cap ? 2 * gz->kept_cap : 256;
+        uint *k = realloc(gz->kept, cap * sizeof(*k));
+        if (k == NULL)
+            return gz_nomem();
+        gz->kept = k;
+        uchar *d = realloc(gz->kept_data, cap * BSIZE);
+        if (d == NULL)
+            return gz_nomem();
+        gz->kept_data = d;
+        gz->kept_cap = cap;
+    }
+    gz->kept[gz->nkept] = bno;
+    memcpy(gz->kept_data + gz->nkept * BSIZE, data, BSIZE);
+    gz->nkept++;
+    return 0;
+}
+
+// The metadata region is complete: mark the blocks the checker will
+// read through the inode table, the indirect blocks of every inode in
+// use and the direct blocks of every directory. The blocks a directory's
+// indirect block names are added when it goes by.
+static int gz_plan(struct gz_pass *ps) {
+    struct image *img = ps->img;
+    const struct superblock *sb = (const struct superblock *)(img->meta + BSIZE);
+    size_t words = (ps->nblocks + 63) / 64;
+
+    ps->wanted = calloc(words ? words : 1, sizeof(uint64_t));
+    ps->dirind = calloc(words ? words : 1, sizeof(uint64_t));
+    if (ps->wanted == NULL || ps->dirind == NULL)
+        return gz_nomem();
+
+    for (uint inum = 0; inum < sb->ninodes; inum++) {
+        uint64_t ib = (uint64_t)sb->inodestart + inum / IPB;
+        if (ib >= img->nmeta)
+            break;
+        const struct dinode *dip = (const struct dinode *)(img->meta + ib * BSIZE) + inum % IPB;
+        if (dip->type == 0)
+            continue;
+        uint ind = dip->addrs[NDIRECT];
+        if (ind >= img->nmeta && ind < ps->nblocks) {
+            BIT_SET(ps->wanted, ind);
+            if (dip->type == T_DIR)
+                BIT_SET(ps->dirind, ind);
+        }
+        if (dip->type != T_DIR)
+            continue;
+        for (uint i = 0; i < NDIRECT; i++)
+            if (dip->addrs[i] >= img->nmeta && dip->addrs[i] < ps->nblocks)
+                BIT_SET(ps->wanted, dip->addrs[i]);
+    }
+    return 0;
+}
+
+// Handle block bno of the image as it streams past
+static int gz_take(struct gz_pass *ps, uint64_t bno, const uchar *data) {
+    struct image *img = ps->img;
+    struct gz *gz = ps->gz;
+
+    if (bno < 2) {
+        memcpy(ps->head + bno * BSIZE, data, BSIZE);
+        if (bno == 0)
+            return 0;
+
+        const struct superblock *sb = (const struct superblock *)(ps->head + BSIZE);
+        ps->nblocks = sb->size < ps->max_blocks ? sb->size : ps->max_blocks;
+        uint64_t nmeta = (uint64_t)sb->bmapstart + ((uint64_t)sb->size + BPB - 1) / BPB;
+        if (nmeta > ps->nblocks)
+            nmeta = ps->nblocks;
+        if (nmeta < 2)
+            nmeta = 2;
+        if (ps->nblocks * BSIZE / GZ_MAXPOINTS > gz->span)
+            gz->span = ps->nblocks * BSIZE / GZ_MAXPOINTS;
+
+        img->meta = calloc(nmeta, BSIZE);
+        if (img->meta == NULL)
+            return gz_nomem();
+        memcpy(img->meta, ps->head, 2 * BSIZE);
+        img->nmeta = nmeta;
+        return nmeta == 2 ? gz_plan(ps) : 0;
+    }
+    if (bno < img->nmeta) {
+        memcpy(img->meta + bno * BSIZE, data, BSIZE);
+        return bno == img->nmeta - 1 ? gz_plan(ps) : 0;
+    }
+    if (ps->wanted == NULL || bno >= ps->nblocks || !BIT_TEST(ps->wanted, bno))
+        return 0;
+
+    if (BIT_TEST(ps->dirind, bno)) {
+        const uint *a = (const uint *)data;
+        for (uint i = 0; i < NINDIRECT; i++)
+            if (a[i] > bno && a[i] < ps->nblocks)
+                BIT_SET(ps->wanted, a[i]);
+    }
+    return gz_keep(gz, bno, data);
+}
+
+// Decompress the whole file once, indexing it and keeping the blocks
+// the checker reads first.
+static int gz_index(struct gz_pass *ps) {
+    struct image *img = ps->img;
+    struct gz *gz = ps->gz;
+    uchar *in = malloc(GZ_CHUNK), *window = malloc(GZ_WINDOW);
+    z_stream strm;
+    uint64_t totin = 0, totout = 0, last = 0, taken = 0;
+    int ret = Z_OK, err = 0, member_start = 1, done = 0;
+
+    memset(&strm, 0, sizeof(strm));
+    if (in == NULL || window == NULL || inflateInit2(&strm, 47) != Z_OK) {
+        free(in);
+        free(window);
+        return gz_nomem();
+    }
+    posix_fadvise(img->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (!done && !err) {
+        if (strm.avail_in == 0) {
+            ssize_t n = read(img->fd, in, GZ_CHUNK);
+            if (n < 0) {
+                fprintf(stderr, "Error: read failed.\n");
+                err = 1;
+                break;
+            }
+            if (n == 0) {
+                if (!member_start) {
+                    fprintf(stderr, "Error: compressed image is truncated.\n");
+                    err = 1;
+                }
+                break;
+            }
+            strm.next_in = in;
+            strm.avail_in = n;
+        }
+        if (strm.avail_out == 0) {
+            strm.next_out = window;
+            strm.avail_out = GZ_WINDOW;
+        }
+
+        uint64_t before_out = totout;
+        totin += strm.avail_in;
+        totout += strm.avail_out;
+        ret = inflate(&strm, Z_BLOCK);
+        totin -= strm.avail_in;
+        totout -= strm.avail_out;
+
+        if (ret == Z_DATA_ERROR && member_start && totout == before_out && totout > 0) {
+            break;              // Trailing bytes after the last member
+        }
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+            fprintf(stderr, "Error: compressed image is corrupt.\n");
+            err = 1;
+            break;
+        }
+        if (totout != before_out)
+            member_start = 0;
+
+        // Whole blocks are contiguous in the window: GZ_WINDOW is a
+        // multiple of BSIZE and output wraps only at its end.
+        while (!err && taken + BSIZE <= totout) {
+            err = gz_take(ps, taken / BSIZE, window + taken % GZ_WINDOW) < 0;
+            taken += BSIZE;
+        }
+
+        if (ret == Z_STREAM_END) {
+            // Another member may follow
+            inflateReset(&strm);
+            member_start = 1;
+            continue;
+        }
+        if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+            (gz->npoints == 0 || totout - last >= gz->span)) {
+            err = gz_add_point(gz, strm.data_type & 7, totin, totout, window) < 0;
+            last = totout;
+        }
+    }
+
+    inflateEnd(&strm);
+    free(in);
+    free(window);
+    if (err)
+        return -1;
+
+    img->size = totout;
+    if (img->meta && img->nmeta > totout / BSIZE)
+        img->nmeta = totout / BSIZE;
+    return 0;
+}
+
+// Index a gzip-compressed image and load its metadata region. Sets
+// img->gz, img->meta, img->nmeta and img->size. Prints a message and
+// returns -1 on failure.
+int gz_open(struct image *img) {
+    struct stat sbuf;
+    if (fstat(img->fd, &sbuf) < 0) {
+        fprintf(stderr, "Error: fstat failed.\n");
+        return -1;
+    }
+
+    struct gz *gz = calloc(1, sizeof(*gz));
+    if (gz == NULL)
+        return gz_nomem();
+    img->gz = gz;
+    gz->span = GZ_SPAN;
+    gz->in = malloc(GZ_CHUNK);
+    gz->scratch = malloc(GZ_CHUNK);
+    if (gz->in == NULL || gz->scratch == NULL)
+        return gz_nomem();
+
+    struct gz_pass ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.img = img;
+    ps.gz = gz;
+    ps.max_blocks = ((uint64_t)sbuf.st_size * GZ_MAXRATIO + BSIZE - 1) / BSIZE + 2;
+    int r = gz_index(&ps);
+    free(ps.wanted);
+    free(ps.dirind);
+    return r;
+}
+
+// Block bno if the pass kept it, else NULL
+const void *gz_block(struct gz *gz, uint bno) {
+    size_t lo = 0, hi = gz->nkept;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (gz->kept[mid] < bno)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < gz->nkept && gz->kept[lo] == bno)
+        return gz->kept_data + lo * BSIZE;
+    return NULL;
+}
+
+// Restart decompression at access point pt
+static int gz_seek(struct gz *gz, int fd, const struct gz_point *pt) {
+    if (gz->live)
+        inflateEnd(&gz->strm);
+    gz->live = 0;
+    memset(&gz->strm, 0, sizeof(gz->strm));
+    if (inflateInit2(&gz->strm, -15) != Z_OK)
+        return gz_nomem();
+    gz->live = 1;
+    gz->raw = 1;
+    gz->fresh = 0;
+    gz->trailer = 0;
+    gz->out = pt->out;
+    gz->in_off = pt->in;
+    if (pt->bits) {
+        uchar c;
+        if (pread(fd, &c, 1, pt->in - 1) != 1) {
+            fprintf(stderr, "Error: read failed.\n");
+            return -1;
+        }
+        inflatePrime(&gz->strm, pt->bits, c >> (8 - pt->bits));
+    }
+    inflateSetDictionary(&gz->strm, pt->window, GZ_WINDOW);
+    return 0;
+}
+
+// Read [off, off + n) of the image into buf, zero-filling past its end.
+// Continues from the previous read when that is no farther back than
+// the nearest access point.
+int gz_read(struct gz *gz, int fd, uchar *buf, uint64_t off, size_t n) {
+    uint lo = 0, hi = gz->npoints;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (gz->points[mid].out <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0) {
+        memset(buf, 0, n);
+        return 0;
+    }
+    const struct gz_point *pt = &gz->points[lo - 1];
+    if (!gz->live || gz->out > off || pt->out > gz->out)
+        if (gz_seek(gz, fd, pt) < 0)
+            return -1;
+
+    z_stream *strm = &gz->strm;
+    int err = 0;
+    while (gz->out < off + n) {
+        if (strm->avail_in == 0) {
+            ssize_t cc = pread(fd, gz->in, GZ_CHUNK, gz->in_off);
+            if (cc < 0) {
+                fprintf(stderr, "Error: read failed.\n");
+                return -1;
+            }
+            if (cc == 0)
+                break;
+            gz->in_off += cc;
+            strm->next_in = gz->in;
+            strm->avail_in = cc;
+        }
+        if (gz->trailer) {
+            uint skip = gz->trailer < strm->avail_in ? gz->trailer : strm->avail_in;
+            strm->next_in += skip;
+            strm->avail_in -= skip;
+            gz->trailer -= skip;
+            if (gz->trailer == 0) {
+                inflateReset2(strm, 31);
+                gz->fresh = 1;
+            }
+            continue;
+        }
+
+        if (gz->out < off) {
+            strm->next_out = gz->scratch;
+            strm->avail_out = off - gz->out < GZ_CHUNK ? off - gz->out : GZ_CHUNK;
+        } else {
+            strm->next_out = buf + (gz->out - off);
+            strm->avail_out = off + n - gz->out;
+        }
+        uint avail = strm->avail_out;
+        int ret = inflate(strm, Z_NO_FLUSH);
+        gz->out += avail - strm->avail_out;
+        if (avail != strm->avail_out)
+            gz->fresh = 0;
+
+        if (ret == Z_STREAM_END) {
+            // The next member starts after this one's 8-byte trailer,
+            // which raw inflate leaves unread
+            if (gz->raw) {
+                gz->raw = 0;
+                gz->trailer = 8;
+            } else {
+                inflateReset(strm);
+                gz->fresh = 1;
+            }
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            // Bytes after the last member end the image
+            if (!gz->fresh) {
+                fprintf(stderr, "Error: compressed image is corrupt.\n");
+                err = 1;
+            }
+            break;
+        }
+    }
+    if (gz->out < off + n) {
+        uint64_t have = gz->out > off ? gz->out - off : 0;
+        memset(buf + have, 0, n - have);
+        inflateEnd(strm);
+        gz->live = 0;
+    }
+    return err ? -1 : 0;
+}
+
+void gz_close(struct gz *gz) {
+    if (gz == NULL)
+        return;
+    if (gz->live)
+        inflateEnd(&gz->strm);
+    free(gz->points);
+    free(gz->kept);
+    free(gz->kept_data);
+    free(gz->in);
+    free(gz->scratch);
+    free(gz);
+}
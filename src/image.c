@@ -0,0 +1,485 @@
+// image.c - Read-only access to an xv6 file system image
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "gzimage.h"
+
+static uchar zero_block[BSIZE];
+
+static uint64_t img_meta_blocks(struct image *img, const uchar *head);
+static void img_advise(struct image *img);
+static int img_map_extents(struct image *img);
+static int img_load_meta(struct image *img);
+static int img_alloc_pool(struct image *img);
+static int img_open_gzip(struct image *img, const char *path);
+static uchar *img_pool_read(struct image *img, uint64_t off);
+
+// Open an image file or block device, or a gzip-compressed image file
+// if flags has IMG_GZIP. Prints a message and returns -1 on failure.
+int img_open(struct image *img, const char *path, int flags) {
+    memset(img, 0, sizeof(*img));
+    img->flags = flags;
+
+    enum img_compression comp = gz_probe(path);
+    if (comp == IMG_ZSTD_DATA) {
+        fprintf(stderr, "Error: %s is zstd-compressed; only gzip is supported.\n", path);
+        return -1;
+    }
+    if (comp == IMG_GZIP_DATA) {
+        if (!(flags & IMG_GZIP)) {
+            fprintf(stderr, "Error: %s is compressed; decompress it first.\n", path);
+            return -1;
+        }
+        return img_open_gzip(img, path);
+    }
+
+    int oflags = O_RDONLY;
+    if (flags & IMG_DIRECT)
+        oflags |= O_DIRECT;
+
+    img->fd = open(path, oflags);
+    if (img->fd < 0 && (flags & IMG_DIRECT) && errno == EINVAL) {
+        // Some file systems (tmpfs) refuse O_DIRECT; keep the pool but
+        // go through the page cache.
+        fprintf(stderr, "warning: O_DIRECT not supported for %s, using buffered reads.\n", path);
+        img->fd = open(path, O_RDONLY);
+    }
+    if (img->fd < 0) {
+        fprintf(stderr, "image not found.\n");
+        return -1;
+    }
+
+    struct stat sbuf;
+    if (fstat(img->fd, &sbuf) < 0) {
+        fprintf(stderr, "Error: fstat failed.\n");
+        close(img->fd);
+        return -1;
+    }
+
+    // st_size is 0 for block devices; ask the device instead.
+    img->align = POOL_SLOT;
+    if (S_ISBLK(sbuf.st_mode)) {
+        int ssz;
+        if (ioctl(img->fd, BLKGETSIZE64, &img->size) < 0) {
+            fprintf(stderr, "Error: BLKGETSIZE64 failed.\n");
+            close(img->fd);
+            return -1;
+        }
+        if (ioctl(img->fd, BLKSSZGET, &ssz) == 0 && ssz > 0 && (uint)ssz <= POOL_SLOT)
+            img->align = ssz < BSIZE ? BSIZE : ssz;
+    } else {
+        img->size = sbuf.st_size;
+    }
+
+    if (img->size < 2 * BSIZE) {
+        fprintf(stderr, "Error: image too small.\n");
+        close(img->fd);
+        return -1;
+    }
+
+    if (img_map_extents(img) < 0) {
+        close(img->fd);
+        return -1;
+    }
+
+    if (flags & IMG_DIRECT) {
+        if (img_load_meta(img) < 0) {
+            img_close(img);
+            return -1;
+        }
+        return 0;
+    }
+
+    int mflags = MAP_PRIVATE;
+    if (flags & IMG_POPULATE)
+        mflags |= MAP_POPULATE;
+    img->map = mmap(NULL, img->size, PROT_READ, mflags, img->fd, 0);
+    if (img->map == MAP_FAILED) {
+        img->map = NULL;
+        fprintf(stderr, "Error: mmap failed.\n");
+        free(img->ext);
+        close(img->fd);
+        return -1;
+    }
+    img->nmeta = img_meta_blocks(img, img->map);
+    img_advise(img);
+    return 0;
+}
+
+// Index a gzip-compressed image and keep its metadata in memory; other
+// blocks are decompressed into the pool as they are asked for.
+static int img_open_gzip(struct image *img, const char *path) {
+    img->fd = open(path, O_RDONLY);
+    if (img->fd < 0) {
+        fprintf(stderr, "image not found.\n");
+        return -1;
+    }
+    img->align = POOL_SLOT;
+    if (gz_open(img) < 0 || img_alloc_pool(img) < 0) {
+        img_close(img);
+        return -1;
+    }
+    if (img->size < 2 * BSIZE) {
+        fprintf(stderr, "Error: image too small.\n");
+        img_close(img);
+        return -1;
+    }
+    return 0;
+}
+
+// Hint the kernel about how each region of the mapping is read: the
+// inode table and bitmap are scanned front to back, while directory and
+// indirect blocks are hit in inode order, which is random on disk.
+// Hints are best effort and failures are ignored.
+static void img_advise(struct image *img) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t meta_end = ((uint64_t)img->nmeta * BSIZE + page - 1) & ~(page - 1);
+
+    if (meta_end > img->size)
+        meta_end = img->size;
+    if (img->flags & IMG_HUGEPAGE)
+        madvise(img->map, img->size, MADV_HUGEPAGE);
+    if (img->flags & IMG_NOADVISE)
+        return;
+
+    madvise(img->map, meta_end, MADV_SEQUENTIAL);
+    madvise(img->map, meta_end, MADV_WILLNEED);
+    if (meta_end < img->size)
+        madvise(img->map + meta_end, img->size - meta_end, MADV_RANDOM);
+}
+
+// Number of blocks from the boot block through the end of the free bit
+// map, given the first two blocks of the image, clamped to the image.
+static uint64_t img_meta_blocks(struct image *img, const uchar *head) {
+    const struct superblock *sb = (const struct superblock *)(head + BSIZE);
+    uint64_t nmeta = (uint64_t)sb->bmapstart + ((uint64_t)sb->size + BPB - 1) / BPB;
+    if (nmeta * BSIZE > img->size)
+        nmeta = img->size / BSIZE;
+    if (nmeta < 2)
+        nmeta = 2;
+    return nmeta;
+}
+
+// Return a pointer to block bno. Metadata blocks stay valid until
+// img_close(); in O_DIRECT mode a data block is only valid until the
+// next img_block() call, so callers that hold one must copy it.
+const void *img_block(struct image *img, uint bno) {
+    if (img->next && img_is_hole(img, bno))
+        return zero_block;
+    if (img->map)
+        return img->map + (uint64_t)bno * BSIZE;
+    if (bno < img->nmeta)
+        return img->meta + (uint64_t)bno * BSIZE;
+    if (img->gz) {
+        const void *b = gz_block(img->gz, bno);
+        if (b)
+            return b;
+    }
+
+    uint64_t off = (uint64_t)bno * BSIZE;
+    uchar *slot = img_pool_read(img, off & ~(uint64_t)(POOL_SLOT - 1));
+    return slot + (off & (POOL_SLOT - 1));
+}
+
+// Index of the first extent ending after block bno.
+static uint img_find_extent(struct image *img, uint bno) {
+    uint lo = 0, hi = img->next;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (img->ext[mid].end <= bno)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Is block bno entirely inside a hole of a sparse image?
+int img_is_hole(struct image *img, uint bno) {
+    if (img->next == 0)
+        return 0;
+    uint i = img_find_extent(img, bno);
+    return i == img->next || img->ext[i].start > bno;
+}
+
+// First block at or after bno that is not in a hole, or ~0 if the rest
+// of the image is a hole. Lets scans jump over holes without touching
+// them.
+uint img_next_data(struct image *img, uint bno) {
+    if (img->next == 0)
+        return bno;
+    uint i = img_find_extent(img, bno);
+    if (i == img->next)
+        return ~0U;
+    return img->ext[i].start > bno ? img->ext[i].start : bno;
+}
+
+void img_close(struct image *img) {
+    if (img->map)
+        munmap(img->map, img->size);
+    free(img->meta);
+    free(img->pool);
+    free(img->pool_tag);
+    free(img->ext);
+    gz_close(img->gz);
+    if (img->fd >= 0)
+        close(img->fd);
+    img->map = img->meta = img->pool = NULL;
+    img->pool_tag = NULL;
+    img->ext = NULL;
+    img->gz = NULL;
+    img->next = 0;
+    img->fd = -1;
+}
+
+// Read [off, off + n) into an aligned buffer, zero-filling past the end
+// of the image.
+static int img_pread(struct image *img, uchar *buf, uint64_t off, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        size_t len = n - done < MAXIO ? n - done : MAXIO;
+        ssize_t cc = pread(img->fd, buf + done, len, off + done);
+        if (cc < 0) {
+            fprintf(stderr, "Error: read failed.\n");
+            return -1;
+        }
+        if (cc == 0)
+            break;
+        done += cc;
+    }
+    memset(buf + done, 0, n - done);
+    return 0;
+}
+
+// Record the data extents of a sparse image with SEEK_DATA/SEEK_HOLE.
+// Leaves next at 0 when the image has no holes or the file system
+// cannot tell us, in which case every block is treated as data.
+static int img_map_extents(struct image *img) {
+    uint cap = 0, n = 0;
+    struct extent *ext = NULL;
+    off_t off = 0;
+
+    while ((uint64_t)off < img->size) {
+        off_t data = lseek(img->fd, off, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO)
+                break;          // Only a hole remains
+            free(ext);
+            return 0;           // SEEK_DATA unsupported
+        }
+        off_t hole = lseek(img->fd, data, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole > img->size)
+            hole = img->size;
+        if (n == cap) {
+            cap = cap ? 2 * cap : 16;
+            struct extent *p = realloc(ext, cap * sizeof(*ext));
+            if (p == NULL) {
+                free(ext);
+                fprintf(stderr, "Error: out of memory.\n");
+                return -1;
+            }
+            ext = p;
+        }
+        ext[n].start = data / BSIZE;
+        ext[n].end = (hole + BSIZE - 1) / BSIZE;
+        if (n > 0 && ext[n - 1].end >= ext[n].start)
+            ext[n - 1].end = ext[n].end;
+        else
+            n++;
+        off = hole;
+    }
+
+    if (n == 1 && ext[0].start == 0 && (uint64_t)ext[0].end * BSIZE >= img->size) {
+        free(ext);
+        return 0;
+    }
+    if (n == 0) {
+        // Entirely sparse: keep one empty extent past the end so that
+        // every lookup finds a hole.
+        free(ext);
+        ext = malloc(sizeof(*ext));
+        if (ext == NULL) {
+            fprintf(stderr, "Error: out of memory.\n");
+            return -1;
+        }
+        ext[0].start = ext[0].end = ~0U;
+        n = 1;
+    }
+    img->ext = ext;
+    img->next = n;
+    return 0;
+}
+
+// Read the boot block through the free bit map in large sequential
+// chunks so the inode and bitmap scans never wait on the device.
+static int img_load_meta(struct image *img) {
+    uchar *head;
+    if (posix_memalign((void **)&head, img->align, POOL_SLOT) != 0) {
+        fprintf(stderr, "Error: out of memory.\n");
+        return -1;
+    }
+    if (img_pread(img, head, 0, POOL_SLOT) < 0) {
+        free(head);
+        return -1;
+    }
+
+    uint64_t nmeta = img_meta_blocks(img, head);
+    free(head);
+
+    size_t len = (nmeta * BSIZE + img->align - 1) & ~(uint64_t)(img->align - 1);
+    if (posix_memalign((void **)&img->meta, img->align, len) != 0) {
+        img->meta = NULL;
+        fprintf(stderr, "Error: out of memory.\n");
+        return -1;
+    }
+    if (img->next == 0) {
+        if (img_pread(img, img->meta, 0, len) < 0)
+            return -1;
+    } else {
+        // Holes read as zeros; only the allocated extents hit the device.
+        memset(img->meta, 0, len);
+        for (uint i = 0; i < img->next && img->ext[i].start < nmeta; i++) {
+            uint64_t start = ((uint64_t)img->ext[i].start * BSIZE) & ~(uint64_t)(img->align - 1);
+            uint64_t end = (uint64_t)(img->ext[i].end < nmeta ? img->ext[i].end : nmeta) * BSIZE;
+            end = (end + img->align - 1) & ~(uint64_t)(img->align - 1);
+            if (end > len)
+                end = len;
+            if (img_pread(img, img->meta + start, start, end - start) < 0)
+                return -1;
+        }
+    }
+    img->nmeta = nmeta;
+    return img_alloc_pool(img);
+}
+
+// Allocate the data block pool with every slot empty.
+static int img_alloc_pool(struct image *img) {
+    if (posix_memalign((void **)&img->pool, img->align, (size_t)POOL_SLOTS * POOL_SLOT) != 0) {
+        img->pool = NULL;
+        fprintf(stderr, "Error: out of memory.\n");
+        return -1;
+    }
+    img->pool_tag = malloc(POOL_SLOTS * sizeof(uint64_t));
+    if (img->pool_tag == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        return -1;
+    }
+    memset(img->pool_tag, 0xff, POOL_SLOTS * sizeof(uint64_t));
+    return 0;
+}
+
+// Direct-mapped pool lookup for the slot holding image offset off.
+static uchar *img_pool_read(struct image *img, uint64_t off) {
+    uint idx = (off / POOL_SLOT) % POOL_SLOTS;
+    uchar *slot = img->pool + (size_t)idx * POOL_SLOT;
+    if (img->pool_tag[idx] != off) {
+        int r = img->gz ? gz_read(img->gz, img->fd, slot, off, POOL_SLOT)
+                        : img_pread(img, slot, off, POOL_SLOT);
+        if (r < 0) {
+            // Hand out zeros but remember the failure, and read again
+            // next time rather than keep the zeros
+            memset(slot, 0, POOL_SLOT);
+            img->io_error = 1;
+            img->pool_tag[idx] = ~0ULL;
+            return slot;
+        }
+        img->pool_tag[idx] = off;
+    }
+    return slot;
+}
+
+// The superblock, if it describes a layout that fits the image. Prints
+// a message and returns NULL if not.
+const struct superblock *img_sb(struct image *img) {
+    const struct superblock *sb = img_block(img, 1);
+    uint inode_end = sb->inodestart + (sb->ninodes + IPB - 1) / IPB;
+
+    if ((uint64_t)sb->size * BSIZE > img->size) {
+        fprintf(stderr, "Error: image is smaller than the file system size.\n");
+        return NULL;
+    }
+    if (sb->inodestart < 2 || inode_end > sb->bmapstart || sb->bmapstart >= sb->size) {
+        fprintf(stderr, "Error: bad superblock.\n");
+        return NULL;
+    }
+    return sb;
+}
+
+// Inode inum, or NULL if the file system has no such inode. The
+// superblock must have passed img_sb().
+const struct dinode *img_inode(struct image *img, uint inum) {
+    const struct superblock *sb = img_block(img, 1);
+
+    if (inum >= sb->ninodes)
+        return NULL;
+    const uchar *b = img_block(img, sb->inodestart + inum / IPB);
+    return (const struct dinode *)(b + (inum % IPB) * sizeof(struct dinode));
+}
+
+// Block holding byte n * BSIZE of the file, or 0 if it has none or its
+// address is outside the file system
+uint img_bmap(struct image *img, const struct dinode *dip, uint n) {
+    const struct superblock *sb = img_block(img, 1);
+    uint addr;
+
+    if (n < NDIRECT) {
+        addr = dip->addrs[n];
+    } else if (n < MAXFILE) {
+        uint ind = dip->addrs[NDIRECT];
+        if (ind == 0 || ind >= sb->size)
+            return 0;
+        addr = ((const uint *)img_block(img, ind))[n - NDIRECT];
+    } else {
+        return 0;
+    }
+    return addr < sb->size ? addr : 0;
+}
+
+// Call fn on each entry in use of directory dip, in order, until it
+// returns non-zero, and return that value. In O_DIRECT mode fn must not
+// read other blocks.
+uint img_each_entry(struct image *img, const struct dinode *dip,
+                    uint (*fn)(const struct dirent *, void *), void *arg) {
+    const uint dpb = BSIZE / sizeof(struct dirent);
+    uint nents = dip->size / sizeof(struct dirent);
+
+    for (uint n = 0; n * dpb < nents && n < MAXFILE; n++) {
+        uint addr = img_bmap(img, dip, n);
+        if (addr == 0)
+            continue;
+        const struct dirent *de = img_block(img, addr);
+        for (uint i = 0; i < dpb && n * dpb + i < nents; i++) {
+            uint r = de[i].inum ? fn(&de[i], arg) : 0;
+            if (r)
+                return r;
+        }
+    }
+    return 0;
+}
+
+static uint match_name(const struct dirent *de, void *name) {
+    return strncmp(de->name, name, DIRSIZ) == 0 ? de->inum : 0;
+}
+
+// Inode that name in directory dir names, or 0; names compare on their
+// first DIRSIZ bytes, as in xv6
+uint img_lookup(struct image *img, uint dir, const char *name) {
+    const struct dinode *dip = img_inode(img, dir);
+
+    if (dip == NULL || dip->type != T_DIR)
+        return 0;
+    return img_each_entry(img, dip, match_name, (void *)name);
+}
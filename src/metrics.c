@@ -0,0 +1,193 @@
+// metrics.c - Prometheus textfile-collector export of xcheck results
+//
+// The file is written next to its destination and renamed into place,
+// so node_exporter never reads a partial file.
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "perf.h"
+#include "stats.h"
+#include "ctx.h"
+#include "metrics.h"
+
+// Label values for the error kinds
+static const char *error_labels[NERRORS] = {
+    [E_BAD_INODE] = "bad_inode",
+    [E_BAD_DIRECT] = "bad_direct_addr",
+    [E_BAD_INDIRECT] = "bad_indirect_addr",
+    [E_NO_ROOT] = "missing_root",
+    [E_DIR_FORMAT] = "dir_not_formatted",
+    [E_ADDR_FREE] = "free_addr_in_use",
+    [E_BMAP_UNUSED] = "bmap_not_in_use",
+    [E_DUP_DIRECT] = "duplicate_direct_addr",
+    [E_DUP_INDIRECT] = "duplicate_indirect_addr",
+    [E_INODE_UNREFERENCED] = "inode_not_found",
+    [E_INODE_FREE_REF] = "inode_referred_not_used",
+    [E_BAD_REFCOUNT] = "bad_ref_count",
+    [E_DIR_MULTI] = "directory_appears_more_than_once",
+    [E_PARENT_MISMATCH] = "parent_mismatch",
+    [E_DIR_UNREACHABLE] = "dir_unreachable",
+    [E_DIR_LOOP] = "dir_loop",
+    [E_DUP_NAME] = "duplicate_name",
+    [E_SCRUB_CHANGED] = "checksum_mismatch",
+};
+
+// One checked image
+struct image_result {
+    char *path;
+    struct superblock sb;
+    int have_sb;
+    int ok;
+};
+
+static struct image_result *results;
+static uint nresults;
+
+// Remember the outcome and geometry of a checked image. sb is NULL if
+// the image could not be opened.
+void metrics_image(const char *path, const struct superblock *sb, int ok) {
+    struct image_result *p = realloc(results, (nresults + 1) * sizeof(*results));
+    if (p == NULL)
+        return;
+    results = p;
+    p = &results[nresults++];
+    memset(p, 0, sizeof(*p));
+    p->path = strdup(path);
+    p->ok = ok;
+    if (sb) {
+        p->sb = *sb;
+        p->have_sb = 1;
+    }
+}
+
+// Write a label value with \, " and newline escaped.
+static void put_label(FILE *f, const char *s) {
+    for (; *s; s++) {
+        if (*s == '\\' || *s == '"')
+            fputc('\\', f);
+        if (*s == '\n')
+            fputs("\\n", f);
+        else
+            fputc(*s, f);
+    }
+}
+
+static void header(FILE *f, const char *name, const char *type, const char *help) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void image_gauge(FILE *f, const char *name, const char *help, size_t off) {
+    header(f, name, "gauge", help);
+    for (uint i = 0; i < nresults; i++) {
+        if (!results[i].have_sb)
+            continue;
+        fprintf(f, "%s{image=\"", name);
+        put_label(f, results[i].path);
+        fprintf(f, "\"} %u\n", *(uint *)((char *)&results[i].sb + off));
+    }
+}
+
+static void write_metrics(FILE *f, struct xcheck *ctx) {
+    double total = 0;
+    struct rusage ru;
+
+    header(f, "xcheck_phase_duration_seconds", "gauge", "Wall-clock time spent in each checker phase.");
+    for (int ph = 0; ph < NPHASES; ph++) {
+        fprintf(f, "xcheck_phase_duration_seconds{phase=\"%s\"} %.6f\n", phase_names[ph], phase_stats[ph].secs);
+        total += phase_stats[ph].secs;
+    }
+    header(f, "xcheck_duration_seconds", "gauge", "Wall-clock time of the whole check.");
+    fprintf(f, "xcheck_duration_seconds %.6f\n", total);
+
+    header(f, "xcheck_inodes_scanned", "gauge", "Inodes examined by the inode scan.");
+    fprintf(f, "xcheck_inodes_scanned %llu\n", (unsigned long long)ctx->inodes_scanned);
+    header(f, "xcheck_blocks_scanned", "gauge", "Inode, indirect, directory, bitmap and scrubbed blocks read.");
+    fprintf(f, "xcheck_blocks_scanned %llu\n", (unsigned long long)ctx->blocks_scanned);
+    header(f, "xcheck_scan_throughput_mbytes_per_second", "gauge", "Blocks scanned per second of check time, in MB/s.");
+    fprintf(f, "xcheck_scan_throughput_mbytes_per_second %.3f\n",
+            total > 0 ? ctx->blocks_scanned * (double)BSIZE / 1e6 / total : 0.0);
+
+    getrusage(RUSAGE_SELF, &ru);
+    header(f, "xcheck_peak_rss_bytes", "gauge", "Peak resident set size of the checker.");
+    fprintf(f, "xcheck_peak_rss_bytes %llu\n", (unsigned long long)ru.ru_maxrss * 1024);
+
+    header(f, "xcheck_errors", "gauge", "Errors found, by kind.");
+    for (int e = 0; e < NERRORS; e++)
+        fprintf(f, "xcheck_errors{kind=\"%s\"} %u\n", error_labels[e], ctx->errors[e]);
+
+    header(f, "xcheck_image_ok", "gauge", "1 if the image passed every enabled check.");
+    for (uint i = 0; i < nresults; i++) {
+        fprintf(f, "xcheck_image_ok{image=\"");
+        put_label(f, results[i].path);
+        fprintf(f, "\"} %d\n", results[i].ok);
+    }
+
+    image_gauge(f, "xcheck_fs_size_blocks", "Size of the file system in blocks.",
+                offsetof(struct superblock, size));
+    image_gauge(f, "xcheck_fs_data_blocks", "Number of data blocks.",
+                offsetof(struct superblock, nblocks));
+    image_gauge(f, "xcheck_fs_inodes", "Number of inodes.",
+                offsetof(struct superblock, ninodes));
+    image_gauge(f, "xcheck_fs_log_blocks", "Number of log blocks.",
+                offsetof(struct superblock, nlog));
+    image_gauge(f, "xcheck_fs_inode_start_block", "First inode block.",
+                offsetof(struct superblock, inodestart));
+    image_gauge(f, "xcheck_fs_bitmap_start_block", "First bitmap block.",
+                offsetof(struct superblock, bmapstart));
+
+    header(f, "xcheck_last_run_timestamp_seconds", "gauge", "Unix time the check finished.");
+    fprintf(f, "xcheck_last_run_timestamp_seconds %lld\n", (long long)time(NULL));
+}
+
+// Forget the images remembered so far.
+static void free_results(void) {
+    for (uint i = 0; i < nresults; i++)
+        free(results[i].path);
+    free(results);
+    results = NULL;
+    nresults = 0;
+}
+
+// Write the metrics to path atomically. Returns -1 on failure.
+static int write_file(const char *path, struct xcheck *ctx) {
+    size_t len = strlen(path) + 32;
+    char *tmp = malloc(len);
+    if (tmp == NULL)
+        return -1;
+    snprintf(tmp, len, "%s.tmp.%d", path, (int)getpid());
+
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror(tmp);
+        free(tmp);
+        return -1;
+    }
+    write_metrics(f, ctx);
+    int err = fflush(f) != 0 || fsync(fileno(f)) != 0;
+    err |= fclose(f) != 0;
+    if (err || rename(tmp, path) != 0) {
+        perror(path);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+// Write the metrics to path, then forget the images. Returns -1 on
+// failure.
+int metrics_write(const char *path, struct xcheck *ctx) {
+    int r = write_file(path, ctx);
+    free_results();
+    return r;
+}
@@ -0,0 +1,244 @@
+// names.c - Name index: directory entries hashed by (directory, name)
+//
+// Built like the owner index: records go into PATH.tmp through a shared
+// mapping and the file is renamed into place once complete. Names
+// compare as xv6 compares them, on their first DIRSIZ bytes.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "names.h"
+
+// FNV-1a over the directory and the name up to its NUL or DIRSIZ bytes
+static uint64_t name_hash(uint parent, const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 4; i++) {
+        h ^= (parent >> (8 * i)) & 0xff;
+        h *= 0x100000001b3ULL;
+    }
+    for (int i = 0; i < DIRSIZ && name[i]; i++) {
+        h ^= (uchar)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static size_t names_len(uint64_t nbuckets, uint64_t n) {
+    return NAMES_DATA + nbuckets * sizeof(uint) + n * sizeof(struct name_rec);
+}
+
+// Start an index with room for n entries. Prints a message and returns
+// -1 on failure.
+int names_create(struct name_index *nx, const char *path, const struct superblock *sb, uint64_t image_size, size_t n) {
+    uint64_t nbuckets = 1;
+
+    memset(nx, 0, sizeof(*nx));
+    nx->fd = -1;
+    nx->path = path;
+    while (nbuckets < n)
+        nbuckets <<= 1;
+    nx->len = names_len(nbuckets, n);
+
+    size_t len = strlen(path) + 8;
+    nx->tmp = malloc(len);
+    if (nx->tmp == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        return -1;
+    }
+    snprintf(nx->tmp, len, "%s.tmp", path);
+
+    nx->fd = open(nx->tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (nx->fd < 0 || ftruncate(nx->fd, nx->len) < 0) {
+        perror(nx->tmp);
+        names_abort(nx);
+        return -1;
+    }
+    nx->map = mmap(NULL, nx->len, PROT_READ | PROT_WRITE, MAP_SHARED, nx->fd, 0);
+    if (nx->map == MAP_FAILED) {
+        nx->map = NULL;
+        perror(nx->tmp);
+        names_abort(nx);
+        return -1;
+    }
+    nx->hdr = (struct names_header *)nx->map;
+    nx->bucket = (uint *)(nx->map + NAMES_DATA);
+    nx->rec = (struct name_rec *)(nx->bucket + nbuckets);
+    nx->hdr->sb = *sb;
+    nx->hdr->image_size = image_size;
+    nx->hdr->nbuckets = nbuckets;
+    return 0;
+}
+
+// Add an entry; at most the n given to names_create()
+void names_add(struct name_index *nx, uint parent, uint child, const char *name, uint pos) {
+    uint64_t b = name_hash(parent, name) & (nx->hdr->nbuckets - 1);
+    struct name_rec *r = &nx->rec[nx->hdr->nnames];
+
+    r->parent = parent;
+    r->child = child;
+    memcpy(r->name, name, DIRSIZ);
+    r->pos = pos;
+    r->next = nx->bucket[b];
+    nx->bucket[b] = ++nx->hdr->nnames;
+}
+
+// Finish the index and move it into place
+int names_commit(struct name_index *nx) {
+    memcpy(nx->hdr->magic, NAMES_MAGIC, sizeof(nx->hdr->magic));
+    int err = msync(nx->map, nx->len, MS_SYNC) < 0;
+    munmap(nx->map, nx->len);
+    nx->map = NULL;
+    err = err || fsync(nx->fd) < 0;
+    err |= close(nx->fd) < 0;
+    nx->fd = -1;
+    if (err || rename(nx->tmp, nx->path) < 0) {
+        perror(nx->path);
+        names_abort(nx);
+        return -1;
+    }
+    free(nx->tmp);
+    nx->tmp = NULL;
+    return 0;
+}
+
+void names_abort(struct name_index *nx) {
+    if (nx->map)
+        munmap(nx->map, nx->len);
+    if (nx->fd >= 0)
+        close(nx->fd);
+    if (nx->tmp) {
+        unlink(nx->tmp);
+        free(nx->tmp);
+    }
+    memset(nx, 0, sizeof(*nx));
+    nx->fd = -1;
+}
+
+// Map an index for lookups. Prints a message and returns -1 on failure.
+int names_load(struct name_index *nx, const char *path) {
+    struct stat st;
+
+    memset(nx, 0, sizeof(*nx));
+    nx->path = path;
+    nx->fd = open(path, O_RDONLY);
+    if (nx->fd < 0 || fstat(nx->fd, &st) < 0) {
+        perror(path);
+        names_unload(nx);
+        return -1;
+    }
+    if ((size_t)st.st_size < NAMES_DATA) {
+        fprintf(stderr, "Error: %s is not a name index.\n", path);
+        names_unload(nx);
+        return -1;
+    }
+    nx->len = st.st_size;
+    nx->map = mmap(NULL, nx->len, PROT_READ, MAP_SHARED, nx->fd, 0);
+    if (nx->map == MAP_FAILED) {
+        nx->map = NULL;
+        perror(path);
+        names_unload(nx);
+        return -1;
+    }
+    nx->hdr = (struct names_header *)nx->map;
+    uint64_t nb = nx->hdr->nbuckets;
+    if (memcmp(nx->hdr->magic, NAMES_MAGIC, sizeof(nx->hdr->magic)) != 0 ||
+        nb == 0 || (nb & (nb - 1)) != 0 || nb > nx->len || nx->hdr->nnames > nx->len ||
+        nx->len < names_len(nb, nx->hdr->nnames)) {
+        fprintf(stderr, "Error: %s is not a name index.\n", path);
+        names_unload(nx);
+        return -1;
+    }
+    nx->bucket = (uint *)(nx->map + NAMES_DATA);
+    nx->rec = (struct name_rec *)(nx->bucket + nb);
+    madvise(nx->map, nx->len, MADV_RANDOM);
+    return 0;
+}
+
+// Inode that name in directory parent names, or 0 if there is no such
+// entry. Sets pos to the entry's place in the directory.
+uint names_lookup(struct name_index *nx, uint parent, const char *name, uint *pos) {
+    uint e = nx->bucket[name_hash(parent, name) & (nx->hdr->nbuckets - 1)];
+
+    // A damaged chain cannot loop longer than there are records
+    for (uint64_t n = 0; e && e <= nx->hdr->nnames && n < nx->hdr->nnames; n++) {
+        const struct name_rec *r = &nx->rec[e - 1];
+        if (r->parent == parent && strncmp(r->name, name, DIRSIZ) == 0) {
+            *pos = r->pos;
+            return r->child;
+        }
+        e = r->next;
+    }
+    return 0;
+}
+
+// Does entry pos of directory dip still name child as name?
+static int entry_at(struct image *img, const struct dinode *dip, uint pos, uint child, const char *name) {
+    const uint dpb = BSIZE / sizeof(struct dirent);
+    uint addr = img_bmap(img, dip, pos / dpb);
+    if (addr == 0)
+        return 0;
+    const struct dirent *de = (const struct dirent *)img_block(img, addr) + pos % dpb;
+    return de->inum == child && strncmp(de->name, name, DIRSIZ) == 0;
+}
+
+// Find the inode at path from the root, through the index nx if not
+// NULL. An index entry is used only if the image still holds it where
+// the index says; otherwise, or if the index has no such entry, the
+// directory is searched, so an out of date index costs time but never
+// gives a wrong answer. Returns 0, or ENOENT, ENOTDIR or ENAMETOOLONG.
+int names_resolve(struct image *img, struct name_index *nx, const char *path, uint *inum) {
+    char name[256];
+    const char *p = path;
+
+    *inum = ROOTINO;
+    if (img_inode(img, ROOTINO) == NULL)
+        return ENOENT;
+    while (*p) {
+        size_t len = strcspn(p, "/");
+        if (len == 0) {
+            p++;
+            continue;
+        }
+        if (len >= sizeof(name))
+            return ENAMETOOLONG;
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+        if (strcmp(name, ".") == 0)
+            continue;
+
+        const struct dinode *dip = img_inode(img, *inum);
+        if (dip == NULL || dip->type != T_DIR)
+            return ENOTDIR;
+        // The index holds no "." or ".." entries
+        uint child = 0, pos;
+        if (nx && strcmp(name, "..") != 0) {
+            child = names_lookup(nx, *inum, name, &pos);
+            if (child && !entry_at(img, dip, pos, child, name))
+                child = 0;
+        }
+        *inum = child ? child : img_lookup(img, *inum, name);
+        if (*inum == 0 || img_inode(img, *inum) == NULL)
+            return ENOENT;
+    }
+    return 0;
+}
+
+void names_unload(struct name_index *nx) {
+    if (nx->map)
+        munmap(nx->map, nx->len);
+    if (nx->fd >= 0)
+        close(nx->fd);
+    memset(nx, 0, sizeof(*nx));
+    nx->fd = -1;
+}
@@ -0,0 +1,137 @@
+// owner.c - Block ownership index: which inode holds each block
+//
+// The index is built in PATH.tmp through a shared mapping, so records go
+// straight to the page cache without a copy, and renamed into place once
+// the header is written. Unclaimed blocks are never touched and stay
+// holes in the file.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "types.h"
+#include "fs.h"
+#include "owner.h"
+
+// Start an index for a file system of sb->size blocks. Prints a message
+// and returns -1 on failure.
+int owner_create(struct owner_index *ox, const char *path, const struct superblock *sb, uint64_t image_size) {
+    memset(ox, 0, sizeof(*ox));
+    ox->fd = -1;
+    ox->path = path;
+    ox->len = OWNER_DATA + (size_t)sb->size * sizeof(struct owner);
+
+    size_t n = strlen(path) + 8;
+    ox->tmp = malloc(n);
+    if (ox->tmp == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        return -1;
+    }
+    snprintf(ox->tmp, n, "%s.tmp", path);
+
+    ox->fd = open(ox->tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (ox->fd < 0 || ftruncate(ox->fd, ox->len) < 0) {
+        perror(ox->tmp);
+        owner_abort(ox);
+        return -1;
+    }
+    ox->map = mmap(NULL, ox->len, PROT_READ | PROT_WRITE, MAP_SHARED, ox->fd, 0);
+    if (ox->map == MAP_FAILED) {
+        ox->map = NULL;
+        perror(ox->tmp);
+        owner_abort(ox);
+        return -1;
+    }
+    ox->hdr = (struct owner_header *)ox->map;
+    ox->rec = (struct owner *)(ox->map + OWNER_DATA);
+    ox->hdr->sb = *sb;
+    ox->hdr->image_size = image_size;
+    ox->hdr->nblocks = sb->size;
+    return 0;
+}
+
+// Finish the index and move it into place. complete says whether every
+// inode was scanned.
+int owner_commit(struct owner_index *ox, int complete) {
+    ox->hdr->complete = complete;
+    memcpy(ox->hdr->magic, OWNER_MAGIC, sizeof(ox->hdr->magic));
+    int err = msync(ox->map, ox->len, MS_SYNC) < 0;
+    munmap(ox->map, ox->len);
+    ox->map = NULL;
+    err = err || fsync(ox->fd) < 0;
+    err |= close(ox->fd) < 0;
+    ox->fd = -1;
+    if (err || rename(ox->tmp, ox->path) < 0) {
+        perror(ox->path);
+        owner_abort(ox);
+        return -1;
+    }
+    free(ox->tmp);
+    ox->tmp = NULL;
+    return 0;
+}
+
+void owner_abort(struct owner_index *ox) {
+    if (ox->map)
+        munmap(ox->map, ox->len);
+    if (ox->fd >= 0)
+        close(ox->fd);
+    if (ox->tmp) {
+        unlink(ox->tmp);
+        free(ox->tmp);
+    }
+    memset(ox, 0, sizeof(*ox));
+    ox->fd = -1;
+}
+
+// Map an index for queries. Prints a message and returns -1 on failure.
+int owner_load(struct owner_index *ox, const char *path) {
+    struct stat st;
+
+    memset(ox, 0, sizeof(*ox));
+    ox->path = path;
+    ox->fd = open(path, O_RDONLY);
+    if (ox->fd < 0 || fstat(ox->fd, &st) < 0) {
+        perror(path);
+        owner_unload(ox);
+        return -1;
+    }
+    if ((size_t)st.st_size < OWNER_DATA) {
+        fprintf(stderr, "Error: %s is not an owner index.\n", path);
+        owner_unload(ox);
+        return -1;
+    }
+    ox->len = st.st_size;
+    ox->map = mmap(NULL, ox->len, PROT_READ, MAP_SHARED, ox->fd, 0);
+    if (ox->map == MAP_FAILED) {
+        ox->map = NULL;
+        perror(path);
+        owner_unload(ox);
+        return -1;
+    }
+    ox->hdr = (struct owner_header *)ox->map;
+    ox->rec = (struct owner *)(ox->map + OWNER_DATA);
+    if (memcmp(ox->hdr->magic, OWNER_MAGIC, sizeof(ox->hdr->magic)) != 0 ||
+        ox->len < OWNER_DATA + ox->hdr->nblocks * sizeof(struct owner)) {
+        fprintf(stderr, "Error: %s is not an owner index.\n", path);
+        owner_unload(ox);
+        return -1;
+    }
+    // Lookups hit scattered records
+    madvise(ox->map, ox->len, MADV_RANDOM);
+    return 0;
+}
+
+void owner_unload(struct owner_index *ox) {
+    if (ox->map)
+        munmap(ox->map, ox->len);
+    if (ox->fd >= 0)
+        close(ox->fd);
+    memset(ox, 0, sizeof(*ox));
+    ox->fd = -1;
+}
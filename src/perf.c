@@ -0,0 +1,93 @@
+// perf.c - Hardware performance counters for xcheck phases
+//
+// Each counter is opened on its own with perf_event_open(2) for this
+// process and inherited by the threads it starts later, such as the
+// scrub workers. An inherited count reaches the parent's when the
+// thread exits, which the phases wait for before they read. Counters
+// the kernel or the machine does not offer (no PMU in a VM,
+// perf_event_paranoid too strict) are left closed and reported as
+// unavailable; the others still work.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf.h"
+
+const char *perf_names[NPERF] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "page_faults"
+};
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[NPERF] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                          PERF_COUNT_HW_CACHE_DTLB |
+                          (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [PERF_PAGE_FAULTS] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+static int perf_fd[NPERF] = {-1, -1, -1, -1, -1};
+
+// Open every counter that is available. Returns the number opened.
+int perf_open(void) {
+    int n = 0;
+
+    for (int c = 0; c < NPERF; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[c].type;
+        attr.config = perf_events[c].config;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+        // Scale for time the counter was multiplexed out
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        perf_fd[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (perf_fd[c] < 0) {
+            // Unprivileged users may only count user space
+            attr.exclude_kernel = 1;
+            perf_fd[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        if (perf_fd[c] >= 0)
+            n++;
+    }
+    return n;
+}
+
+int perf_available(enum perf_counter c) {
+    return perf_fd[c] >= 0;
+}
+
+// Current value of every counter, scaled for multiplexing. Unavailable
+// counters read as 0.
+void perf_read(uint64_t counts[NPERF]) {
+    for (int c = 0; c < NPERF; c++) {
+        uint64_t buf[3];
+        counts[c] = 0;
+        if (perf_fd[c] < 0 || read(perf_fd[c], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+        if (buf[2] != 0 && buf[2] < buf[1])
+            counts[c] = (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+        else
+            counts[c] = buf[0];
+    }
+}
+
+void perf_close(void) {
+    for (int c = 0; c < NPERF; c++) {
+        if (perf_fd[c] >= 0)
+            close(perf_fd[c]);
+        perf_fd[c] = -1;
+    }
+}
@@ -0,0 +1,152 @@
+// progress.c - Timer-driven progress reporting for long checks
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "perf.h"
+#include "stats.h"
+#include "ctx.h"
+#include "progress.h"
+
+struct progress progress;
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int running;
+static int stopping;
+
+static struct xcheck *pctx;
+static double period;
+static const char *status_path;
+
+// Called by the checker when a phase starts. total is the number of
+// items (inodes or blocks) the phase walks.
+void progress_phase(const char *image, int phase, uint64_t total) {
+    __atomic_store_n(&progress.pos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress.total, total, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress.image, image, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress.phase, phase, __ATOMIC_RELEASE);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void format_eta(char *buf, size_t n, double secs) {
+    if (secs < 0 || secs > 99 * 3600.0) {
+        snprintf(buf, n, "--:--:--");
+        return;
+    }
+    long s = (long)secs;
+    snprintf(buf, n, "%02ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+}
+
+// Replace the status file atomically so a poller never reads half of it.
+static void write_status(const char *image, int phase, uint64_t pos, uint64_t total,
+                         uint64_t inodes, uint64_t blocks, double mbps, double eta) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", status_path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        return;
+    fprintf(f, "image=%s\nphase=%s\nposition=%llu\ntotal=%llu\n"
+               "inodes_scanned=%llu\ninodes_total=%u\nblocks_scanned=%llu\nblocks_total=%u\n"
+               "mbytes_per_second=%.3f\neta_seconds=%.0f\n",
+            image ? image : "", phase_names[phase],
+            (unsigned long long)pos, (unsigned long long)total,
+            (unsigned long long)inodes, __atomic_load_n(&pctx->ninodes, __ATOMIC_RELAXED),
+            (unsigned long long)blocks, __atomic_load_n(&pctx->size, __ATOMIC_RELAXED),
+            mbps, eta);
+    if (fclose(f) == 0)
+        rename(tmp, status_path);
+    else
+        unlink(tmp);
+}
+
+static void *progress_main(void *arg) {
+    (void)arg;
+    double last = now();
+    uint64_t last_blocks = 0, last_pos = 0;
+    int last_phase = -1;
+
+    pthread_mutex_lock(&lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        double t = deadline.tv_sec + deadline.tv_nsec / 1e9 + period;
+        deadline.tv_sec = (time_t)t;
+        deadline.tv_nsec = (long)((t - deadline.tv_sec) * 1e9);
+        pthread_cond_timedwait(&wake, &lock, &deadline);
+        if (stopping)
+            break;
+
+        int phase = __atomic_load_n(&progress.phase, __ATOMIC_ACQUIRE);
+        const char *image = __atomic_load_n(&progress.image, __ATOMIC_RELAXED);
+        uint64_t pos = __atomic_load_n(&progress.pos, __ATOMIC_RELAXED);
+        uint64_t total = __atomic_load_n(&progress.total, __ATOMIC_RELAXED);
+        uint64_t inodes = __atomic_load_n(&pctx->inodes_scanned, __ATOMIC_RELAXED);
+        uint64_t blocks = __atomic_load_n(&pctx->blocks_scanned, __ATOMIC_RELAXED);
+
+        double t1 = now(), dt = t1 - last;
+        if (phase != last_phase)
+            last_pos = 0;
+        double mbps = dt > 0 ? (blocks - last_blocks) * (double)BSIZE / 1e6 / dt : 0;
+        double rate = dt > 0 && pos > last_pos ? (pos - last_pos) / dt : 0;
+        double eta = rate > 0 && total > pos ? (total - pos) / rate : (total <= pos ? 0 : -1);
+        last = t1;
+        last_blocks = blocks;
+        last_pos = pos;
+        last_phase = phase;
+
+        if (status_path) {
+            write_status(image, phase, pos, total, inodes, blocks, mbps, eta);
+        } else {
+            char etabuf[16];
+            format_eta(etabuf, sizeof(etabuf), eta);
+            fprintf(stderr, "xcheck: %s: %s %5.1f%% (%llu/%llu), %llu inodes, %llu blocks, %.1f MB/s, phase ETA %s\n",
+                    image ? image : "", phase_names[phase],
+                    total ? 100.0 * pos / total : 100.0,
+                    (unsigned long long)pos, (unsigned long long)total,
+                    (unsigned long long)inodes, (unsigned long long)blocks, mbps, etabuf);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Start reporting every interval seconds, to status_file if it is set
+// and to stderr otherwise.
+int progress_start(struct xcheck *ctx, double interval, const char *status_file) {
+    pctx = ctx;
+    period = interval > 0 ? interval : 5;
+    status_path = status_file;
+    stopping = 0;
+    if (pthread_create(&thread, NULL, progress_main, NULL) != 0) {
+        fprintf(stderr, "Error: cannot start progress thread.\n");
+        return -1;
+    }
+    running = 1;
+    return 0;
+}
+
+void progress_stop(void) {
+    if (!running)
+        return;
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    running = 0;
+}
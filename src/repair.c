@@ -0,0 +1,151 @@
+// repair.c - Rewrite the bitmap words and link counts a check found wrong
+//
+// The image is opened for writing only once the whole check has passed
+// but for the planned fixes. Bitmap words for consecutive blocks are
+// consecutive on disk, so each run of them is one pwrite(); a link count
+// is one two-byte write into its inode.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "types.h"
+#include "fs.h"
+#include "repair.h"
+
+// Grow *arr, of *cap elements of size bytes, to hold one more than n.
+// Prints a message and returns -1 on failure.
+static int grow(void **arr, size_t *cap, size_t n, size_t size) {
+    if (n < *cap)
+        return 0;
+    size_t c = *cap ? 2 * *cap : 64;
+    void *p = realloc(*arr, c * size);
+    if (p == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        return -1;
+    }
+    *arr = p;
+    *cap = c;
+    return 0;
+}
+
+// Plan to rewrite the bitmap word for blocks [base, base + 64)
+int repair_word(struct repair *rp, uint base, uint64_t was, uint64_t now) {
+    if (grow((void **)&rp->words, &rp->words_cap, rp->nwords, sizeof(*rp->words)) < 0)
+        return -1;
+    rp->words[rp->nwords++] = (struct bitmap_fix){base, was, now};
+    return 0;
+}
+
+// Plan to set the link count of inode inum
+int repair_nlink(struct repair *rp, uint inum, short was, short now) {
+    if (grow((void **)&rp->links, &rp->links_cap, rp->nlinks, sizeof(*rp->links)) < 0)
+        return -1;
+    rp->links[rp->nlinks++] = (struct nlink_fix){inum, was, now};
+    return 0;
+}
+
+static void print_run(FILE *out, uint first, uint last, int in_use) {
+    if (first == last)
+        fprintf(out, "block %u: mark %s\n", first, in_use ? "in use" : "free");
+    else
+        fprintf(out, "blocks %u-%u: mark %s\n", first, last, in_use ? "in use" : "free");
+}
+
+// List the planned fixes, bitmap changes as runs of blocks
+static void print_plan(FILE *out, const struct repair *rp) {
+    uint first = 0, last = 0;
+    int in_use = -1;
+
+    for (size_t i = 0; i < rp->nwords; i++) {
+        const struct bitmap_fix *f = &rp->words[i];
+        for (uint64_t bits = f->was ^ f->now; bits; bits &= bits - 1) {
+            uint b = f->base + __builtin_ctzll(bits);
+            int set = (f->now >> (b - f->base)) & 1;
+            if (in_use == set && b == last + 1) {
+                last = b;
+                continue;
+            }
+            if (in_use >= 0)
+                print_run(out, first, last, in_use);
+            first = last = b;
+            in_use = set;
+        }
+    }
+    if (in_use >= 0)
+        print_run(out, first, last, in_use);
+    for (size_t i = 0; i < rp->nlinks; i++)
+        fprintf(out, "inode %u: link count %d -> %d\n", rp->links[i].inum, rp->links[i].was, rp->links[i].now);
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t w = pwrite(fd, buf, len, off);
+        if (w <= 0)
+            return -1;
+        buf = (const uchar *)buf + w;
+        len -= w;
+        off += w;
+    }
+    return 0;
+}
+
+// Print the plan for the image at path and, unless dry_run, write it.
+// Prints a message and returns -1 on failure.
+int repair_apply(FILE *out, const char *path, const struct superblock *sb, struct repair *rp, int dry_run) {
+    size_t nwrites = 0, nbytes = 0;
+    uchar buf[4096];
+    int fd = -1, err = 0;
+
+    print_plan(out, rp);
+    if (!dry_run && (fd = open(path, O_WRONLY)) < 0) {
+        perror(path);
+        return -1;
+    }
+    // Runs of words for consecutive blocks, up to a buffer at a time
+    for (size_t i = 0; i < rp->nwords && !err; ) {
+        const struct bitmap_fix *f = &rp->words[i];
+        off_t off = (off_t)(sb->bmapstart + f->base / BPB) * BSIZE + (f->base % BPB) / 8;
+        size_t len = 0;
+        do {
+            for (int k = 0; k < 8; k++)
+                buf[len + k] = rp->words[i].now >> (8 * k);
+            len += 8;
+            i++;
+        } while (i < rp->nwords && rp->words[i].base == rp->words[i - 1].base + 64 && len < sizeof(buf));
+        err = fd >= 0 && write_all(fd, buf, len, off) < 0;
+        nwrites++;
+        nbytes += len;
+    }
+    for (size_t i = 0; i < rp->nlinks && !err; i++) {
+        uint inum = rp->links[i].inum;
+        off_t off = (off_t)(sb->inodestart + inum / IPB) * BSIZE + (inum % IPB) * sizeof(struct dinode) +
+                    offsetof(struct dinode, nlink);
+        ushort v = (ushort)rp->links[i].now;
+        uchar le[2] = {v & 0xff, v >> 8};
+        err = fd >= 0 && write_all(fd, le, sizeof(le), off) < 0;
+        nwrites++;
+        nbytes += sizeof(le);
+    }
+    if (fd >= 0) {
+        err = err || fsync(fd) < 0;
+        err |= close(fd) < 0;
+    }
+    if (err) {
+        perror(path);
+        return -1;
+    }
+    fprintf(out, "%s: %zu bitmap words and %zu link counts %s in %zu writes of %zu bytes\n", path,
+            rp->nwords, rp->nlinks, dry_run ? "to rewrite" : "rewritten", nwrites, nbytes);
+    return 0;
+}
+
+void repair_free(struct repair *rp) {
+    free(rp->words);
+    free(rp->links);
+    memset(rp, 0, sizeof(*rp));
+}
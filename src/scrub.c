@@ -0,0 +1,441 @@
+// scrub.c - Block checksums for finding silent corruption
+//
+// Checksums are CRC32C. On x86-64 CPUs with SSE4.2 the crc32 instruction
+// does eight bytes at a time, three blocks interleaved so that its
+// latency is hidden; elsewhere a slicing-by-8 table does the same work in
+// software. Threads take chunks of blocks from a shared counter and only
+// read the allocated ones: the metadata region and the blocks marked in
+// the bitmap.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "perf.h"
+#include "stats.h"
+#include "ctx.h"
+#include "progress.h"
+#include "scrub.h"
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+#define SCRUB_THREADS 64     // Most threads a scrub starts
+
+#define CRC32C_POLY 0x82f63b78   // Castagnoli, bit-reversed
+
+static uint32_t crc_table[8][256];
+
+static void crc_init_table(void) {
+    for (uint i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (uint i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+}
+
+static inline uint32_t load32(const uchar *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Checksum n blocks from p into out[0..n)
+static void crc_blocks_sw(const uchar *p, uint n, uint32_t *out) {
+    for (uint b = 0; b < n; b++, p += BSIZE) {
+        uint32_t c = ~0u;
+        for (uint i = 0; i < BSIZE; i += 8) {
+            uint32_t lo = c ^ load32(p + i), hi = load32(p + i + 4);
+            c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+                crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+                crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+                crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        }
+        out[b] = ~c;
+    }
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static void crc_blocks_hw(const uchar *p, uint n, uint32_t *out) {
+    uint b = 0;
+
+    // Three independent chains: crc32 takes three cycles but a new one
+    // can start every cycle
+    for (; b + 3 <= n; b += 3, p += 3 * BSIZE) {
+        uint64_t c0 = ~0u, c1 = ~0u, c2 = ~0u;
+        for (uint i = 0; i < BSIZE; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + BSIZE + i, 8);
+            memcpy(&w2, p + 2 * BSIZE + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        out[b] = ~(uint32_t)c0;
+        out[b + 1] = ~(uint32_t)c1;
+        out[b + 2] = ~(uint32_t)c2;
+    }
+    for (; b < n; b++, p += BSIZE) {
+        uint64_t c = ~0u;
+        for (uint i = 0; i < BSIZE; i += 8) {
+            uint64_t w;
+            memcpy(&w, p + i, 8);
+            c = _mm_crc32_u64(c, w);
+        }
+        out[b] = ~(uint32_t)c;
+    }
+}
+#endif
+
+static void (*crc_blocks)(const uchar *, uint, uint32_t *);
+
+static void crc_select(void) {
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_blocks = crc_blocks_hw;
+        return;
+    }
+#endif
+    crc_init_table();
+    crc_blocks = crc_blocks_sw;
+}
+
+// Bytes of the checksum array, padded so the bitset is 8-byte aligned
+static size_t crc_bytes(uint64_t nblocks) {
+    return (nblocks * sizeof(uint32_t) + 7) & ~(size_t)7;
+}
+
+static void scrub_layout(struct scrub_store *ss) {
+    ss->hdr = (struct scrub_header *)ss->map;
+    ss->crc = (uint32_t *)(ss->map + SCRUB_DATA);
+    ss->covered = (uint64_t *)(ss->map + SCRUB_DATA + crc_bytes(ss->hdr->nblocks));
+}
+
+// Start a store for a file system of sb->size blocks. Prints a message
+// and returns -1 on failure.
+int scrub_create(struct scrub_store *ss, const char *path, const struct superblock *sb, uint64_t image_size) {
+    memset(ss, 0, sizeof(*ss));
+    ss->fd = -1;
+    ss->path = path;
+    ss->len = SCRUB_DATA + crc_bytes(sb->size) + ((size_t)sb->size + 63) / 64 * sizeof(uint64_t);
+
+    size_t n = strlen(path) + 8;
+    ss->tmp = malloc(n);
+    if (ss->tmp == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        return -1;
+    }
+    snprintf(ss->tmp, n, "%s.tmp", path);
+
+    ss->fd = open(ss->tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (ss->fd < 0 || ftruncate(ss->fd, ss->len) < 0) {
+        perror(ss->tmp);
+        scrub_abort(ss);
+        return -1;
+    }
+    ss->map = mmap(NULL, ss->len, PROT_READ | PROT_WRITE, MAP_SHARED, ss->fd, 0);
+    if (ss->map == MAP_FAILED) {
+        ss->map = NULL;
+        perror(ss->tmp);
+        scrub_abort(ss);
+        return -1;
+    }
+    ss->hdr = (struct scrub_header *)ss->map;
+    ss->hdr->sb = *sb;
+    ss->hdr->image_size = image_size;
+    ss->hdr->nblocks = sb->size;
+    scrub_layout(ss);
+    return 0;
+}
+
+// Finish the store and move it into place
+int scrub_commit(struct scrub_store *ss) {
+    memcpy(ss->hdr->magic, SCRUB_MAGIC, sizeof(ss->hdr->magic));
+    int err = msync(ss->map, ss->len, MS_SYNC) < 0;
+    munmap(ss->map, ss->len);
+    ss->map = NULL;
+    err = err || fsync(ss->fd) < 0;
+    err |= close(ss->fd) < 0;
+    ss->fd = -1;
+    if (err || rename(ss->tmp, ss->path) < 0) {
+        perror(ss->path);
+        scrub_abort(ss);
+        return -1;
+    }
+    free(ss->tmp);
+    ss->tmp = NULL;
+    return 0;
+}
+
+void scrub_abort(struct scrub_store *ss) {
+    if (ss->map)
+        munmap(ss->map, ss->len);
+    if (ss->fd >= 0)
+        close(ss->fd);
+    if (ss->tmp) {
+        unlink(ss->tmp);
+        free(ss->tmp);
+    }
+    memset(ss, 0, sizeof(*ss));
+    ss->fd = -1;
+}
+
+// Map a store to compare against. Prints a message and returns -1 on
+// failure.
+int scrub_load(struct scrub_store *ss, const char *path) {
+    struct stat st;
+
+    memset(ss, 0, sizeof(*ss));
+    ss->path = path;
+    ss->fd = open(path, O_RDONLY);
+    if (ss->fd < 0 || fstat(ss->fd, &st) < 0) {
+        perror(path);
+        scrub_unload(ss);
+        return -1;
+    }
+    if ((size_t)st.st_size < SCRUB_DATA) {
+        fprintf(stderr, "Error: %s is not a checksum store.\n", path);
+        scrub_unload(ss);
+        return -1;
+    }
+    ss->len = st.st_size;
+    ss->map = mmap(NULL, ss->len, PROT_READ, MAP_SHARED, ss->fd, 0);
+    if (ss->map == MAP_FAILED) {
+        ss->map = NULL;
+        perror(path);
+        scrub_unload(ss);
+        return -1;
+    }
+    ss->hdr = (struct scrub_header *)ss->map;
+    if (memcmp(ss->hdr->magic, SCRUB_MAGIC, sizeof(ss->hdr->magic)) != 0 ||
+        ss->len < SCRUB_DATA + crc_bytes(ss->hdr->nblocks) + (ss->hdr->nblocks + 63) / 64 * sizeof(uint64_t)) {
+        fprintf(stderr, "Error: %s is not a checksum store.\n", path);
+        scrub_unload(ss);
+        return -1;
+    }
+    scrub_layout(ss);
+    // Read front to back alongside the image
+    madvise(ss->map, ss->len, MADV_SEQUENTIAL);
+    return 0;
+}
+
+void scrub_unload(struct scrub_store *ss) {
+    if (ss->map)
+        munmap(ss->map, ss->len);
+    if (ss->fd >= 0)
+        close(ss->fd);
+    memset(ss, 0, sizeof(*ss));
+    ss->fd = -1;
+}
+
+// Bitset of the allocated blocks: everything before the data blocks,
+// and the data blocks marked in the bitmap
+static uint64_t *alloc_map(struct image *img, const struct superblock *sb) {
+    size_t words = ((size_t)sb->size + 63) / 64;
+    uint64_t *set = malloc(words * sizeof(uint64_t));
+    uint data_start = sb->bmapstart + (sb->size + BPB - 1) / BPB;
+
+    if (set == NULL)
+        return NULL;
+    for (size_t w = 0; w < words; w++) {
+        uint64_t base = w * 64;
+        const uchar *bp = (const uchar *)img_block(img, sb->bmapstart + base / BPB) + (base % BPB) / 8;
+        uint64_t word = 0;
+        for (int i = 0; i < 8; i++)
+            word |= (uint64_t)bp[i] << (8 * i);
+        if (base + 64 <= data_start)
+            word = ~(uint64_t)0;
+        else if (base < data_start)
+            word |= ((uint64_t)1 << (data_start - base)) - 1;
+        if (base + 64 > sb->size)
+            word &= ((uint64_t)1 << (sb->size - base)) - 1;
+        set[w] = word;
+    }
+    return set;
+}
+
+// Work shared by the scrub threads
+struct scrub_job {
+    struct image *img;
+    struct scrub_store *ss;
+    const uint64_t *alloc;
+    uint64_t *changed_map;
+    uint nblocks;
+    int write;
+    uint64_t next;           // First block of the next chunk
+    uint64_t checked;
+    uint64_t changed;
+    uint64_t added;
+    int failed;
+};
+
+// Blocks [b, e) of the image, read into buf if it is not mapped
+static const uchar *read_run(struct image *img, uchar *buf, uint b, uint e) {
+    if (img->map)
+        return img->map + (uint64_t)b * BSIZE;
+
+    uint64_t off = (uint64_t)b * BSIZE;
+    uint64_t start = off & ~(uint64_t)(img->align - 1);
+    uint64_t want = (uint64_t)e * BSIZE - start;
+    size_t len = (want + img->align - 1) & ~(uint64_t)(img->align - 1);
+    size_t got = 0;
+
+    while (got < want) {
+        ssize_t n = pread(img->fd, buf + got, len - got, start + got);
+        if (n <= 0)
+            return NULL;
+        got += n;
+    }
+    return buf + (off - start);
+}
+
+static void *scrub_worker(void *arg) {
+    struct scrub_job *job = arg;
+    struct image *img = job->img;
+    struct scrub_store *ss = job->ss;
+    uint32_t crc[SCRUB_CHUNK];
+    uint64_t checked = 0, changed = 0, added = 0;
+    uchar *buf = NULL;
+
+    if (img->map == NULL &&
+        posix_memalign((void **)&buf, img->align, (size_t)SCRUB_CHUNK * BSIZE + 2 * img->align) != 0) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    for (;;) {
+        uint64_t first = __atomic_fetch_add(&job->next, SCRUB_CHUNK, __ATOMIC_RELAXED);
+        if (first >= job->nblocks || __atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+            break;
+        uint end = first + SCRUB_CHUNK < job->nblocks ? first + SCRUB_CHUNK : job->nblocks;
+        PROGRESS_POS(first);
+
+        // Runs of allocated blocks; chunks start on a word, so a free
+        // word is skipped whole
+        for (uint b = first; b < end; ) {
+            if (b % 64 == 0 && job->alloc[b / 64] == 0) {
+                b += 64;
+                continue;
+            }
+            if (!bit_test(job->alloc, b)) {
+                b++;
+                continue;
+            }
+            uint e = b + 1;
+            while (e < end && bit_test(job->alloc, e))
+                e++;
+            const uchar *p = read_run(img, buf, b, e);
+            if (p == NULL) {
+                __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (job->write) {
+                crc_blocks(p, e - b, ss->crc + b);
+            } else {
+                crc_blocks(p, e - b, crc);
+                for (uint i = b; i < e; i++) {
+                    if (!bit_test(ss->covered, i)) {
+                        added++;
+                    } else if (ss->crc[i] != crc[i - b]) {
+                        __atomic_fetch_or(&job->changed_map[i / 64], (uint64_t)1 << (i % 64), __ATOMIC_RELAXED);
+                        changed++;
+                    }
+                }
+            }
+            checked += e - b;
+            b = e;
+        }
+    }
+    __atomic_fetch_add(&job->checked, checked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->changed, changed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->added, added, __ATOMIC_RELAXED);
+    free(buf);
+    return NULL;
+}
+
+// Checksum every allocated block of img with nthreads threads (0: one
+// per CPU). With write set the checksums go into ss, a new store;
+// otherwise they are compared with it. Prints a message and returns -1
+// on failure.
+int scrub_run(struct image *img, struct scrub_store *ss, int write, int nthreads, struct scrub_result *res) {
+    const struct superblock *sb = (const struct superblock *)img_block(img, 1);
+    size_t words = ((size_t)sb->size + 63) / 64;
+    struct timespec t0, t1;
+
+    memset(res, 0, sizeof(*res));
+    if (!write && (memcmp(&ss->hdr->sb, sb, sizeof(*sb)) != 0 || ss->hdr->image_size != img->size)) {
+        fprintf(stderr, "Error: %s was not written for this image.\n", ss->path);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (crc_blocks == NULL)
+        crc_select();
+
+    struct scrub_job job = {.img = img, .ss = ss, .nblocks = sb->size, .write = write};
+    uint64_t *alloc = alloc_map(img, sb);
+    if (!write)
+        job.changed_map = res->changed_map = calloc(words, sizeof(uint64_t));
+    if (alloc == NULL || (!write && res->changed_map == NULL)) {
+        fprintf(stderr, "Error: out of memory.\n");
+        free(alloc);
+        free(res->changed_map);
+        res->changed_map = NULL;
+        return -1;
+    }
+    job.alloc = alloc;
+    if (img->map && !(img->flags & IMG_NOADVISE))
+        madvise(img->map, img->size, MADV_SEQUENTIAL);
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > SCRUB_THREADS)
+        nthreads = SCRUB_THREADS;
+    if (nthreads < 1)
+        nthreads = 1;
+    // The calling thread is one of the workers; if a thread cannot be
+    // started the others take its share
+    pthread_t tid[SCRUB_THREADS];
+    int started = 0;
+    while (started < nthreads - 1 && pthread_create(&tid[started], NULL, scrub_worker, &job) == 0)
+        started++;
+    scrub_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(tid[i], NULL);
+
+    if (!job.failed) {
+        if (write) {
+            memcpy(ss->covered, alloc, words * sizeof(uint64_t));
+            ss->hdr->covered = job.checked;
+        } else {
+            for (size_t w = 0; w < words; w++)
+                res->dropped += __builtin_popcountll(ss->covered[w] & ~alloc[w]);
+        }
+    }
+    free(alloc);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    res->checked = job.checked;
+    res->changed = job.changed;
+    res->added = job.added;
+    res->secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (job.failed) {
+        fprintf(stderr, "Error: cannot read the image for the scrub.\n");
+        free(res->changed_map);
+        res->changed_map = NULL;
+        return -1;
+    }
+    return 0;
+}
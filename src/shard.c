@@ -0,0 +1,228 @@
+// shard.c - Partial results of a sharded check and their merge
+//
+// Layout: a header, then the types, link counts and parents of the
+// shard's inodes, the non-zero pages of the used and indirect block
+// bitsets as (page number, page) records, and the directory entries as
+// (directory, target) pairs. Everything is in host order; shards are
+// merged on the same architecture that wrote them.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "perf.h"
+#include "stats.h"
+#include "ctx.h"
+#include "shard.h"
+
+#define SHARD_MAGIC "XSHARD4\n"
+#define PAGE_WORDS  512     // Bitset words per page record
+
+struct shard_header {
+    char magic[8];
+    int checks;
+    uint first, end;
+    uint pad;
+    uint64_t image_size;
+    struct superblock sb;
+    uint64_t used_pages;    // Page records of block_used
+    uint64_t indirect_pages; // Page records of block_indirect
+    uint64_t nedges;
+    uint64_t edge_off;
+    uint64_t inodes_scanned;
+    uint64_t blocks_scanned;
+    uint errors[NERRORS];
+};
+
+static size_t bitset_words(struct xcheck *ctx) {
+    return NEED_BLOCK_MAPS(ctx->checks) ? ((size_t)ctx->size + 63) / 64 : 0;
+}
+
+static int page_empty(const uint64_t *map, size_t words, size_t page) {
+    size_t end = (page + 1) * PAGE_WORDS < words ? (page + 1) * PAGE_WORDS : words;
+    for (size_t i = page * PAGE_WORDS; i < end; i++) {
+        if (map[i])
+            return 0;
+    }
+    return 1;
+}
+
+static uint64_t count_pages(const uint64_t *map, size_t words) {
+    uint64_t n = 0;
+    for (size_t p = 0; p * PAGE_WORDS < words; p++)
+        n += !page_empty(map, words, p);
+    return n;
+}
+
+static int write_pages(FILE *f, const uint64_t *map, size_t words) {
+    for (size_t p = 0; p * PAGE_WORDS < words; p++) {
+        if (page_empty(map, words, p))
+            continue;
+        uint64_t page[PAGE_WORDS] = {0};
+        uint32_t pno = p;
+        size_t n = words - p * PAGE_WORDS < PAGE_WORDS ? words - p * PAGE_WORDS : PAGE_WORDS;
+        memcpy(page, map + p * PAGE_WORDS, n * sizeof(uint64_t));
+        if (fwrite(&pno, sizeof(pno), 1, f) != 1 || fwrite(page, sizeof(page), 1, f) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+// Bytes of per-inode arrays for n inodes
+static uint64_t inode_bytes(struct xcheck *ctx, uint64_t n) {
+    uint64_t b = n * sizeof(*ctx->inode_type);
+    if (ctx->inode_nlink)
+        b += n * sizeof(*ctx->inode_nlink);
+    if (ctx->inode_parent)
+        b += n * sizeof(*ctx->inode_parent);
+    return b;
+}
+
+// Write the partial result of the shard run in ctx. Returns -1 on
+// failure.
+int shard_write(struct xcheck *ctx, const char *path) {
+    struct shard_header h;
+    size_t words = bitset_words(ctx);
+    uint n = ctx->scan_end - ctx->scan_first;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SHARD_MAGIC, sizeof(h.magic));
+    h.checks = ctx->checks;
+    h.first = ctx->scan_first;
+    h.end = ctx->scan_end;
+    h.image_size = ctx->img->size;
+    h.sb = *(const struct superblock *)img_block(ctx->img, 1);
+    h.used_pages = words ? count_pages(ctx->block_used, words) : 0;
+    h.indirect_pages = words ? count_pages(ctx->block_indirect, words) : 0;
+    h.nedges = ctx->nedges;
+    h.edge_off = sizeof(h) + inode_bytes(ctx, n) +
+                 (h.used_pages + h.indirect_pages) * (sizeof(uint32_t) + PAGE_WORDS * sizeof(uint64_t));
+    h.inodes_scanned = ctx->inodes_scanned;
+    h.blocks_scanned = ctx->blocks_scanned;
+    memcpy(h.errors, ctx->errors, sizeof(h.errors));
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    int err = fwrite(&h, sizeof(h), 1, f) != 1;
+    err = err || fwrite(ctx->inode_type + h.first, sizeof(*ctx->inode_type), n, f) != n;
+    if (ctx->inode_nlink)
+        err = err || fwrite(ctx->inode_nlink + h.first, sizeof(*ctx->inode_nlink), n, f) != n;
+    if (ctx->inode_parent)
+        err = err || fwrite(ctx->inode_parent + h.first, sizeof(*ctx->inode_parent), n, f) != n;
+    if (words) {
+        err = err || write_pages(f, ctx->block_used, words) < 0;
+        err = err || write_pages(f, ctx->block_indirect, words) < 0;
+    }
+    err = err || fwrite(ctx->edges, sizeof(*ctx->edges), ctx->nedges, f) != ctx->nedges;
+    err = err || fflush(f) != 0 || fsync(fileno(f)) != 0;
+    err |= fclose(f) != 0;
+    if (err) {
+        perror(path);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Open a shard and check that it was taken on the image and with the
+// checks in ctx. Prints a message and returns -1 if not.
+int shard_open(struct xcheck *ctx, struct shard *sh, const char *path) {
+    struct shard_header h;
+
+    memset(sh, 0, sizeof(*sh));
+    sh->path = path;
+    sh->f = fopen(path, "r");
+    if (sh->f == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fread(&h, sizeof(h), 1, sh->f) != 1 || memcmp(h.magic, SHARD_MAGIC, sizeof(h.magic)) != 0) {
+        fprintf(stderr, "Error: %s is not a shard.\n", path);
+        shard_close(sh);
+        return -1;
+    }
+    if (h.checks != ctx->checks || h.image_size != ctx->img->size ||
+        memcmp(&h.sb, img_block(ctx->img, 1), sizeof(h.sb)) != 0 ||
+        h.first >= h.end || h.end > ctx->ninodes) {
+        fprintf(stderr, "Error: shard %s was not taken on this image with these checks.\n", path);
+        shard_close(sh);
+        return -1;
+    }
+    sh->first = h.first;
+    sh->end = h.end;
+    sh->nedges = h.nedges;
+    sh->edge_off = h.edge_off;
+    sh->inodes_scanned = h.inodes_scanned;
+    sh->blocks_scanned = h.blocks_scanned;
+    memcpy(sh->errors, h.errors, sizeof(sh->errors));
+    sh->used_pages = h.used_pages;
+    sh->indirect_pages = h.indirect_pages;
+    return 0;
+}
+
+static int read_pages(struct shard *sh, uint64_t *map, size_t words, uint64_t npages) {
+    memset(map, 0, words * sizeof(uint64_t));
+    for (uint64_t i = 0; i < npages; i++) {
+        uint64_t page[PAGE_WORDS];
+        uint32_t pno;
+        if (fread(&pno, sizeof(pno), 1, sh->f) != 1 || fread(page, sizeof(page), 1, sh->f) != 1 ||
+            (size_t)pno * PAGE_WORDS >= words)
+            return -1;
+        size_t n = words - (size_t)pno * PAGE_WORDS < PAGE_WORDS ? words - (size_t)pno * PAGE_WORDS : PAGE_WORDS;
+        memcpy(map + (size_t)pno * PAGE_WORDS, page, n * sizeof(uint64_t));
+    }
+    return 0;
+}
+
+// Copy the shard's inode arrays into ctx and its block bitsets into
+// used and indirect, which have room for the whole image. Leaves the
+// file at the directory entries.
+int shard_load(struct xcheck *ctx, struct shard *sh, uint64_t *used, uint64_t *indirect) {
+    size_t words = bitset_words(ctx);
+    uint n = sh->end - sh->first;
+    int err = fread(ctx->inode_type + sh->first, sizeof(*ctx->inode_type), n, sh->f) != n;
+    if (ctx->inode_nlink)
+        err = err || fread(ctx->inode_nlink + sh->first, sizeof(*ctx->inode_nlink), n, sh->f) != n;
+    if (ctx->inode_parent)
+        err = err || fread(ctx->inode_parent + sh->first, sizeof(*ctx->inode_parent), n, sh->f) != n;
+    if (words) {
+        err = err || read_pages(sh, used, words, sh->used_pages) < 0;
+        err = err || read_pages(sh, indirect, words, sh->indirect_pages) < 0;
+    }
+    if (err || ftello(sh->f) != (off_t)sh->edge_off) {
+        fprintf(stderr, "Error: shard %s is truncated.\n", sh->path);
+        return -1;
+    }
+    return 0;
+}
+
+// Reopen a loaded shard at its directory entries
+int shard_seek_edges(struct shard *sh) {
+    if (sh->f == NULL)
+        sh->f = fopen(sh->path, "r");
+    if (sh->f == NULL || fseeko(sh->f, sh->edge_off, SEEK_SET) != 0) {
+        perror(sh->path);
+        return -1;
+    }
+    return 0;
+}
+
+// Read up to max directory entries from where the last call stopped.
+// Returns 0 at the end of the shard.
+size_t shard_edges(struct shard *sh, struct edge *buf, size_t max) {
+    return fread(buf, sizeof(*buf), max, sh->f);
+}
+
+void shard_close(struct shard *sh) {
+    if (sh->f)
+        fclose(sh->f);
+    sh->f = NULL;
+}
@@ -0,0 +1,101 @@
+// stats.c - Per-phase timing and resource usage for xcheck
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "perf.h"
+#include "stats.h"
+
+struct phase_stats phase_stats[NPHASES];
+
+const char *phase_names[NPHASES] = {
+    "open", "inodes", "dirs", "links", "tree", "bitmap", "scrub"
+};
+
+static struct timespec start_time[NPHASES];
+static struct rusage start_usage[NPHASES];
+static uint64_t start_perf[NPHASES][NPERF];
+static int perf_on;
+
+// Count hardware events per phase from now on. Falls back to timings
+// only if no counter can be opened.
+void stats_enable_perf(void) {
+    if (perf_open() == 0)
+        fprintf(stderr, "warning: no performance counters available.\n");
+    else
+        perf_on = 1;
+}
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+void stats_begin(enum phase ph) {
+    getrusage(RUSAGE_SELF, &start_usage[ph]);
+    clock_gettime(CLOCK_MONOTONIC, &start_time[ph]);
+    if (perf_on)
+        perf_read(start_perf[ph]);
+}
+
+void stats_end(enum phase ph) {
+    struct timespec now;
+    struct rusage ru;
+
+    if (perf_on) {
+        uint64_t counts[NPERF];
+        perf_read(counts);
+        for (int c = 0; c < NPERF; c++)
+            phase_stats[ph].perf[c] += counts[c] - start_perf[ph][c];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &ru);
+    phase_stats[ph].secs += elapsed(&start_time[ph], &now);
+    phase_stats[ph].minflt += ru.ru_minflt - start_usage[ph].ru_minflt;
+    phase_stats[ph].majflt += ru.ru_majflt - start_usage[ph].ru_majflt;
+}
+
+static void report_line(FILE *f, const char *name, struct phase_stats *ps) {
+    fprintf(f, "%-8s %10.6f %10ld %10ld", name, ps->secs, ps->minflt, ps->majflt);
+    if (perf_on) {
+        for (int c = 0; c < NPERF; c++) {
+            if (perf_available(c))
+                fprintf(f, " %14llu", (unsigned long long)ps->perf[c]);
+            else
+                fprintf(f, " %14s", "-");
+        }
+        if (perf_available(PERF_CYCLES) && perf_available(PERF_INSTRUCTIONS) && ps->perf[PERF_CYCLES])
+            fprintf(f, " %6.2f", (double)ps->perf[PERF_INSTRUCTIONS] / ps->perf[PERF_CYCLES]);
+        else
+            fprintf(f, " %6s", "-");
+    }
+    fputc('\n', f);
+}
+
+// Print one line per phase, then the totals.
+void stats_report(FILE *f) {
+    struct phase_stats total;
+    memset(&total, 0, sizeof(total));
+
+    fprintf(f, "%-8s %10s %10s %10s", "phase", "seconds", "minflt", "majflt");
+    if (perf_on) {
+        for (int c = 0; c < NPERF; c++)
+            fprintf(f, " %14s", perf_names[c]);
+        fprintf(f, " %6s", "ipc");
+    }
+    fputc('\n', f);
+
+    for (int ph = 0; ph < NPHASES; ph++) {
+        struct phase_stats *ps = &phase_stats[ph];
+        report_line(f, phase_names[ph], ps);
+        total.secs += ps->secs;
+        total.minflt += ps->minflt;
+        total.majflt += ps->majflt;
+        for (int c = 0; c < NPERF; c++)
+            total.perf[c] += ps->perf[c];
+    }
+    report_line(f, "total", &total);
+}
@@ -0,0 +1,154 @@
+// usage.c - Space usage of one image (--usage)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "perf.h"
+#include "stats.h"
+#include "ctx.h"
+#include "usage.h"
+
+static const char *type_names[USAGE_TYPES] = {"bad type", "directories", "files", "devices"};
+
+// Prints a message and returns -1 if the per-inode counts cannot be
+// allocated.
+int usage_init(struct usage *u, uint ninodes) {
+    memset(u, 0, sizeof(*u));
+    u->blocks = calloc(ninodes ? ninodes : 1, sizeof(*u->blocks));
+    if (u->blocks == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Inode inum of type (T_BAD for a bad one) is size bytes long and holds
+// nblocks blocks
+void usage_inode(struct usage *u, uint inum, int type, uint size, uint nblocks) {
+    int t = type == T_DIR || type == T_FILE || type == T_DEV ? type : 0;
+
+    u->blocks[inum] = nblocks;
+    u->inodes[t]++;
+    u->bytes[t] += size;
+    u->nblocks[t] += nblocks;
+    if (type != T_FILE || (u->ntop == USAGE_TOP && size <= u->top_size[USAGE_TOP - 1]))
+        return;
+
+    int i = u->ntop < USAGE_TOP ? u->ntop++ : USAGE_TOP - 1;
+    for (; i > 0 && u->top_size[i - 1] < size; i--) {
+        u->top_inum[i] = u->top_inum[i - 1];
+        u->top_size[i] = u->top_size[i - 1];
+    }
+    u->top_inum[i] = inum;
+    u->top_size[i] = size;
+}
+
+static void print_path(FILE *out, struct xcheck *ctx, uint inum) {
+    char path[4096];
+
+    if (inum == ROOTINO) {
+        fprintf(out, "/\n");
+    } else if (inum < ctx->ninodes && ctx->inode_name[inum]) {
+        ctx_path(ctx, &ctx->names[ctx->inode_name[inum] - 1], path, sizeof(path));
+        fprintf(out, "%s\n", path);
+    } else {
+        fprintf(out, "(inode %u, not in any directory)\n", inum);
+    }
+}
+
+// Directory holding inum by its newest name, or 0 if it has none
+static uint parent_of(struct xcheck *ctx, uint inum) {
+    uint e = ctx->inode_name[inum];
+    return e ? ctx->names[e - 1].parent : 0;
+}
+
+static double pct(uint64_t a, uint64_t b) {
+    return b ? 100.0 * a / b : 0;
+}
+
+// Print the report. The name table must be complete: every inode's
+// blocks are added to the directory that names it and to each directory
+// above that, up to the root.
+void usage_report(FILE *out, struct xcheck *ctx, struct usage *u, int partial) {
+    uint64_t used = 0, claimed = 0, detached = 0;
+    uint64_t *tree = calloc(ctx->ninodes ? ctx->ninodes : 1, sizeof(*tree));
+
+    for (int t = 0; t < USAGE_TYPES; t++) {
+        used += u->inodes[t];
+        claimed += u->nblocks[t];
+    }
+    fprintf(out, "usage of %s%s\n", ctx->name, partial ? " (partial: the check stopped at an error)" : "");
+    fprintf(out, "inodes: %llu used of %u (%.1f%%)\n",
+            (unsigned long long)used, ctx->ninodes, pct(used, ctx->ninodes));
+    fprintf(out, "data blocks: %llu used of %u (%.1f%%), %llu free, %llu held by inodes\n",
+            (unsigned long long)u->data_used, ctx->size - ctx->data_start,
+            pct(u->data_used, ctx->size - ctx->data_start), (unsigned long long)u->data_free,
+            (unsigned long long)claimed);
+    for (int t = 1; t <= USAGE_TYPES; t++) {
+        int i = t % USAGE_TYPES;
+        if (i == 0 && u->inodes[0] == 0)
+            continue;
+        fprintf(out, "%s: %llu, %llu bytes in %llu blocks\n", type_names[i], (unsigned long long)u->inodes[i],
+                (unsigned long long)u->bytes[i], (unsigned long long)u->nblocks[i]);
+    }
+
+    fprintf(out, "largest files:\n");
+    for (int i = 0; i < u->ntop; i++) {
+        fprintf(out, "  %12u bytes  ", u->top_size[i]);
+        print_path(out, ctx, u->top_inum[i]);
+    }
+    if (tree == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        return;
+    }
+
+    // A directory's own blocks count in its subtree; anything else's in
+    // the subtree of the directory naming it
+    for (uint inum = 1; inum < ctx->ninodes; inum++) {
+        if (u->blocks[inum] == 0)
+            continue;
+        uint x = ctx->inode_type[inum] == T_DIR ? inum : parent_of(ctx, inum);
+        for (uint depth = 0; ; depth++) {
+            if (x == 0 || x >= ctx->ninodes || depth > ctx->ninodes) {
+                detached += u->blocks[inum];
+                break;
+            }
+            tree[x] += u->blocks[inum];
+            if (x == ROOTINO)
+                break;
+            x = parent_of(ctx, x);
+        }
+    }
+
+    // Largest subtrees, by selection: there are at most USAGE_TOP
+    uint top[USAGE_TOP];
+    int ntop = 0;
+    for (uint inum = 1; inum < ctx->ninodes; inum++) {
+        if (ctx->inode_type[inum] != T_DIR || tree[inum] == 0)
+            continue;
+        if (ntop == USAGE_TOP && tree[inum] <= tree[top[USAGE_TOP - 1]])
+            continue;
+        int i = ntop < USAGE_TOP ? ntop++ : USAGE_TOP - 1;
+        for (; i > 0 && tree[top[i - 1]] < tree[inum]; i--)
+            top[i] = top[i - 1];
+        top[i] = inum;
+    }
+    fprintf(out, "largest directory subtrees:\n");
+    for (int i = 0; i < ntop; i++) {
+        fprintf(out, "  %12llu blocks ", (unsigned long long)tree[top[i]]);
+        print_path(out, ctx, top[i]);
+    }
+    if (detached)
+        fprintf(out, "not under the root: %llu blocks\n", (unsigned long long)detached);
+    free(tree);
+}
+
+void usage_free(struct usage *u) {
+    free(u->blocks);
+    u->blocks = NULL;
+}
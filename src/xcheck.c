@@ -1,24 +1,58 @@
 // xcheck.c
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
-#include "fs.h"
+#include <getopt.h>
+#include <signal.h>
 #include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "perf.h"
+#include "stats.h"
+#include "ctx.h"
+#include "metrics.h"
+#include "trace.h"
+#include "progress.h"
+#include "checkpoint.h"
+#include "shard.h"
+#include "owner.h"
+#include "names.h"
+#include "frag.h"
+#include "usage.h"
+#include "dirblock.h"
+#include "scrub.h"
+#include "repair.h"
 
-#define UNUSED 0
-#define DIRECT 1
-#define INDIRECT 2
+static const char *error_msgs[NERRORS] = {
+    [E_BAD_INODE] = "bad inode.",
+    [E_BAD_DIRECT] = "bad direct address in inode.",
+    [E_BAD_INDIRECT] = "bad indirect address in inode.",
+    [E_NO_ROOT] = "root directory does not exist.",
+    [E_DIR_FORMAT] = "directory not properly formatted.",
+    [E_ADDR_FREE] = "address used by inode but marked free in bitmap.",
+    [E_BMAP_UNUSED] = "bitmap marks block in use but it is not in use.",
+    [E_DUP_DIRECT] = "direct address used more than once.",
+    [E_DUP_INDIRECT] = "indirect address used more than once.",
+    [E_INODE_UNREFERENCED] = "inode marked use but not found in a directory.",
+    [E_INODE_FREE_REF] = "inode referred to in directory but marked free.",
+    [E_BAD_REFCOUNT] = "bad reference count for file.",
+    [E_DIR_MULTI] = "directory appears more than once in file system.",
+    [E_PARENT_MISMATCH] = "parent directory mismatch.",
+    [E_DIR_UNREACHABLE] = "directory not reachable from the root directory.",
+    [E_DIR_LOOP] = "directory entry names the root directory, forming a loop.",
+    [E_DUP_NAME] = "name appears more than once in a directory.",
+    [E_SCRUB_CHANGED] = "block contents changed since the checksums were written.",
+};
 
 // Function prototypes
-int block_is_marked(void *img_ptr, struct superblock *sb, uint blocknum);
-struct dinode *get_inode(void *img_ptr, struct superblock *sb, uint inum);
-void process_directory_block(void *img_ptr, uint addr, uint dir_inum, int *dot_found, int *dotdot_found, int *inode_referenced, int *inode_type, int *inode_used, int *inode_linkcount, int *inode_parent, uint num_inodes);
+int block_is_marked(struct xcheck *ctx, uint blocknum);
+struct dinode *get_inode(struct xcheck *ctx, uint inum);
+int process_directory_block(struct xcheck *ctx, uint addr, uint dir_inum, uint fbn, int *dot_found, int *dotdot_found);
 
 ushort xshort(ushort x) {
     uchar *a = (uchar *)&x;
@@ -30,355 +64,1346 @@ uint xint(uint x) {
     return ((uint)a[0]) | ((uint)a[1] << 8) | ((uint)a[2] << 16) | ((uint)a[3] << 24);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: xcheck <file_system_image>\n");
-        exit(1);
+// Report an error and return -1 so checks can "return xerr(...)".
+static int xerr(struct xcheck *ctx, enum xerr kind) {
+    ctx->errors[kind]++;
+    if (ctx->batch)
+        fprintf(stderr, "%s: ", ctx->name);
+    fprintf(stderr, "ERROR: %s\n", error_msgs[kind]);
+    return -1;
+}
+
+// Count a mismatch --repair will fix instead of stopping, reporting
+// each kind once per image
+static void xrepair(struct xcheck *ctx, enum xerr kind) {
+    ctx->errors[kind]++;
+    if (ctx->repair->kinds & (1U << kind))
+        return;
+    ctx->repair->kinds |= 1U << kind;
+    if (ctx->batch)
+        fprintf(stderr, "%s: ", ctx->name);
+    fprintf(stderr, "ERROR: %s\n", error_msgs[kind]);
+}
+
+// Report an error about inode inum and, if not 0, block; --paths prints
+// where they are at the end of the check.
+static int xerr_at(struct xcheck *ctx, enum xerr kind, uint inum, uint block) {
+    memset(&ctx->detail, 0, sizeof(ctx->detail));
+    ctx->detail.inum = inum;
+    ctx->detail.block = block;
+    return xerr(ctx, kind);
+}
+
+// Report an error about the entry name in directory dir
+static int xerr_entry(struct xcheck *ctx, enum xerr kind, uint dir, const char *name, uint target) {
+    memset(&ctx->detail, 0, sizeof(ctx->detail));
+    ctx->detail.inum = target;
+    ctx->detail.dir = dir;
+    memcpy(ctx->detail.name, name, DIRSIZ);
+    return xerr(ctx, kind);
+}
+
+// Is addr a data block? Out-of-range addresses are never followed,
+// whether or not CHK_ADDRS reports them.
+static inline int valid_addr(struct xcheck *ctx, uint addr) {
+    return addr >= ctx->data_start && addr < ctx->size;
+}
+
+// Claim block addr for slot of inode inum (see owner.h); slots from
+// OWN_INDIRECT on were found through the indirect block or are the
+// indirect block itself. Returns 1 if the block may be read, 0 if it
+// must be skipped, -1 on error.
+static int claim_block(struct xcheck *ctx, uint addr, uint inum, uint slot) {
+    int c = ctx->checks;
+    int from_indirect = slot >= OWN_INDIRECT;
+
+    if (!valid_addr(ctx, addr)) {
+        if (c & CHK_ADDRS)
+            return xerr_at(ctx, from_indirect ? E_BAD_INDIRECT : E_BAD_DIRECT, inum, 0);
+        return 0;
+    }
+    if (ctx->block_owner)
+        owner_note(ctx->block_owner, addr, inum, slot);
+    if (!NEED_BLOCK_MAPS(c))
+        return 1;
+    if (bit_test(ctx->block_used, addr)) {
+        if (c & CHK_DUPS)
+            return xerr_at(ctx, bit_test(ctx->block_indirect, addr) ? E_DUP_INDIRECT : E_DUP_DIRECT, inum, addr);
+        return 1;
     }
+    bit_set(ctx->block_used, addr);
+    if (from_indirect)
+        bit_set(ctx->block_indirect, addr);
+    // Check that block is marked in bitmap; a repair rebuilds the bitmap
+    // after the scan instead
+    if ((c & CHK_BITMAP) && !ctx->repair && !block_is_marked(ctx, addr))
+        return xerr_at(ctx, E_ADDR_FREE, inum, addr);
+    return 1;
+}
 
-    int fd = open(argv[1], O_RDONLY);
-    if (fd < 0) {
-        fprintf(stderr, "image not found.\n");
-        exit(1);
+// Process inodes: types, address ranges, duplicate blocks
+static int check_inodes(struct xcheck *ctx) {
+    struct image *img = ctx->img;
+    uint inode_end = ctx->inodestart + (ctx->scan_end + IPB - 1) / IPB;
+    uint start = ctx->resume_phase == PHASE_INODES ? ctx->resume_pos : ctx->scan_first;
+
+    for (uint inum = start; inum < ctx->scan_end; inum++) {
+        // Inode blocks in a hole of a sparse image hold only free
+        // inodes; jump to the next allocated extent without touching them.
+        uint iblock = ctx->inodestart + inum / IPB;
+        if (inum % IPB == 0 && img_is_hole(img, iblock)) {
+            uint next = img_next_data(img, iblock);
+            if (next >= inode_end)
+                break;
+            inum = (next - ctx->inodestart) * IPB - 1;
+            continue;
+        }
+
+        if (inum % IPB == 0) {
+            if (ckpt_due)
+                ckpt_write(ctx, PHASE_INODES, inum);
+            XTRACE2(inode__batch, inum, iblock);
+            PROGRESS_POS(inum);
+            COUNT(ctx->blocks_scanned);
+        }
+        COUNT(ctx->inodes_scanned);
+
+        struct dinode *dip = get_inode(ctx, inum);
+        int type = xshort(dip->type);
+
+        // Check 1: Each inode is either unallocated or one of the valid types
+        if (type == 0)
+            continue;
+        if (type != T_FILE && type != T_DIR && type != T_DEV) {
+            if (ctx->checks & CHK_TYPES)
+                return xerr_at(ctx, E_BAD_INODE, inum, 0);
+            type = T_BAD;
+        }
+
+        ctx->inode_type[inum] = type;
+        if (ctx->inode_nlink)
+            ctx->inode_nlink[inum] = xshort(dip->nlink);
+        if (!NEED_BLOCK_WALK(ctx->checks) && !ctx->block_owner && !ctx->frag && !ctx->usage)
+            continue;
+
+        // Process direct blocks
+        struct frag_walk fw = {0};
+        uint held = 0;
+        for (int i = 0; i < NDIRECT; i++) {
+            uint addr = xint(dip->addrs[i]);
+            if (addr == 0)
+                continue;
+            int claimed = claim_block(ctx, addr, inum, i);
+            if (claimed < 0)
+                return -1;
+            held += claimed;
+            if (claimed && ctx->frag)
+                frag_block(ctx->frag, &fw, addr);
+        }
+
+        // Process indirect block
+        uint indirect_addr = xint(dip->addrs[NDIRECT]);
+        int r = indirect_addr ? claim_block(ctx, indirect_addr, inum, OWN_INDIRECT) : 0;
+        if (r < 0)
+            return -1;
+        held += r;
+        if (r && ctx->frag)
+            frag_indirect(ctx->frag, &fw, indirect_addr);
+
+        // Read indirect block; one in a hole has no entries
+        if (r && !img_is_hole(img, indirect_addr)) {
+            COUNT(ctx->blocks_scanned);
+            uint indirect_block[NINDIRECT];
+            memcpy(indirect_block, img_block(img, indirect_addr), BSIZE);
+            for (uint i = 0; i < NINDIRECT; i++) {
+                uint addr = xint(indirect_block[i]);
+                if (addr == 0)
+                    continue;
+                int claimed = claim_block(ctx, addr, inum, OWN_ENTRY(i));
+                if (claimed < 0)
+                    return -1;
+                held += claimed;
+                if (claimed && ctx->frag)
+                    frag_block(ctx->frag, &fw, addr);
+            }
+        }
+        if (ctx->frag && (type == T_FILE || type == T_DIR))
+            frag_file(ctx->frag, &fw);
+        if (ctx->usage)
+            usage_inode(ctx->usage, inum, type, xint(dip->size), held);
     }
 
-    struct stat sbuf;
-    if (fstat(fd, &sbuf) < 0) {
-        fprintf(stderr, "Error: fstat failed.\n");
-        close(fd);
-        exit(1);
+    // Check if root inode is allocated; a shard after the one holding
+    // it leaves this to --merge
+    if ((ctx->checks & CHK_DIRS) && ctx->scan_first <= ROOTINO &&
+        (ctx->scan_end <= ROOTINO || !ctx->inode_type[ROOTINO]))
+        return xerr(ctx, E_NO_ROOT);
+    return 0;
+}
+
+// Process directories: format, references and parents
+static int check_dirs(struct xcheck *ctx) {
+    struct image *img = ctx->img;
+    uint start = ctx->resume_phase == PHASE_DIRS ? ctx->resume_pos : ctx->scan_first;
+
+    for (uint inum = start; inum < ctx->scan_end; inum++) {
+        if (ctx->inode_type[inum] != T_DIR)
+            continue;
+        if (ckpt_due)
+            ckpt_write(ctx, PHASE_DIRS, inum);
+        PROGRESS_POS(inum);
+        ctx->names_next = inum;
+        ctx->names_done = ctx->nnames;
+
+        struct dinode *dip = get_inode(ctx, inum);
+        int dot_found = 0;
+        int dotdot_found = 0;
+
+        // Process direct blocks
+        for (int i = 0; i < NDIRECT; i++) {
+            uint addr = xint(dip->addrs[i]);
+            if (valid_addr(ctx, addr) && process_directory_block(ctx, addr, inum, i, &dot_found, &dotdot_found) < 0)
+                return -1;
+        }
+
+        // Process indirect block
+        uint indirect_addr = xint(dip->addrs[NDIRECT]);
+        if (valid_addr(ctx, indirect_addr) && !img_is_hole(img, indirect_addr)) {
+            COUNT(ctx->blocks_scanned);
+            uint indirect_block[NINDIRECT];
+            memcpy(indirect_block, img_block(img, indirect_addr), BSIZE);
+            for (uint i = 0; i < NINDIRECT; i++) {
+                uint addr = xint(indirect_block[i]);
+                if (valid_addr(ctx, addr) &&
+                    process_directory_block(ctx, addr, inum, NDIRECT + i, &dot_found, &dotdot_found) < 0)
+                    return -1;
+            }
+        }
+
+        if (!(ctx->checks & CHK_DIRS))
+            continue;
+        if (!dot_found || !dotdot_found)
+            return xerr_at(ctx, E_DIR_FORMAT, inum, 0);
+
+        // For root directory, check that parent is itself
+        if (inum == ROOTINO && ctx->inode_parent[inum] != ROOTINO)
+            return xerr(ctx, E_NO_ROOT);
     }
+    ctx->names_next = ctx->ninodes;
+    ctx->names_done = ctx->nnames;
+    return 0;
+}
 
-    void *img_ptr = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (img_ptr == MAP_FAILED) {
-        fprintf(stderr, "Error: mmap failed.\n");
-        close(fd);
-        exit(1);
+// Check that every inode in use is referenced, with the right count
+static int check_links(struct xcheck *ctx) {
+    // Check for inodes marked in use but not found in a directory
+    for (uint inum = 1; inum < ctx->ninodes && (ctx->checks & CHK_REACH); inum++) {
+        if (ctx->inode_type[inum] && ctx->inode_type[inum] != T_DIR && !ctx->inode_refs[inum])
+            return xerr_at(ctx, E_INODE_UNREFERENCED, inum, 0);
+    }
+
+    // Check reference counts for files and directories
+    for (uint inum = 1; inum < ctx->ninodes && (ctx->checks & CHK_REFS); inum++) {
+        if (ctx->inode_type[inum] == T_FILE) {
+            if ((uint)ctx->inode_nlink[inum] == ctx->inode_refs[inum])
+                continue;
+            // nlink is a short; a count past it cannot be written back
+            if (!ctx->repair || ctx->inode_refs[inum] > SHRT_MAX)
+                return xerr_at(ctx, E_BAD_REFCOUNT, inum, 0);
+            xrepair(ctx, E_BAD_REFCOUNT);
+            if (repair_nlink(ctx->repair, inum, ctx->inode_nlink[inum], ctx->inode_refs[inum]) < 0)
+                return -1;
+        } else if (ctx->inode_type[inum] == T_DIR) {
+            if (ctx->inode_refs[inum] > 1 && inum != ROOTINO)
+                return xerr_at(ctx, E_DIR_MULTI, inum, 0);
+        }
+    }
+    return 0;
+}
+
+// Call fn on each block address of directory inum and its index in the
+// directory, direct then through the indirect block, without checking
+// the directory. fn skips the addresses it cannot read. Returns -1 if
+// fn does.
+static int each_dir_block(struct xcheck *ctx, uint inum, int (*fn)(struct xcheck *, uint, uint, uint)) {
+    struct dinode *dip = get_inode(ctx, inum);
+
+    for (int i = 0; i < NDIRECT; i++) {
+        if (fn(ctx, xint(dip->addrs[i]), inum, i) < 0)
+            return -1;
+    }
+    uint indirect_addr = xint(dip->addrs[NDIRECT]);
+    if (valid_addr(ctx, indirect_addr) && !img_is_hole(ctx->img, indirect_addr)) {
+        uint indirect_block[NINDIRECT];
+        memcpy(indirect_block, img_block(ctx->img, indirect_addr), BSIZE);
+        for (uint i = 0; i < NINDIRECT; i++) {
+            if (fn(ctx, xint(indirect_block[i]), inum, NDIRECT + i) < 0)
+                return -1;
+        }
     }
+    return 0;
+}
 
-    struct superblock *sb = (struct superblock *)(img_ptr + BSIZE);
+// Add the entries in directory block addr of dir that name directories
+static int edge_block(struct xcheck *ctx, uint addr, uint dir, uint fbn) {
+    (void)fbn;
+    if (!valid_addr(ctx, addr) || img_is_hole(ctx->img, addr))
+        return 0;
+    const struct dirent *de = img_block(ctx->img, addr);
+    for (uint i = 0; i < BSIZE / sizeof(struct dirent); i++) {
+        uint ref = xshort(de[i].inum);
+        if (ref == 0 || ref >= ctx->ninodes || ctx->inode_type[ref] != T_DIR ||
+            strncmp(de[i].name, ".", DIRSIZ) == 0 || strncmp(de[i].name, "..", DIRSIZ) == 0)
+            continue;
+        if (ctx_add_edge(ctx, dir, ref) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-    uint num_inodes = xint(sb->ninodes);
-    uint num_blocks = xint(sb->size);
+// Walk down from the root over the entries naming directories. start
+// has room for ninodes + 2 counts, queue for one entry per edge plus the
+// root, and seen is a zeroed bitset over the inodes.
+static int walk_tree(struct xcheck *ctx, uint *start, uint *child, uint *queue, uint64_t *seen) {
+    uint n = ctx->ninodes;
 
-    // Compute data block start
-    uint bmapstart = xint(sb->bmapstart);
-    uint sb_size = xint(sb->size);
-    uint num_bitmap_blocks = (sb_size + BPB - 1) / BPB;
-    uint data_block_start = bmapstart + num_bitmap_blocks;
+    // Group the edges by parent with a counting sort: afterwards the
+    // children of p are child[start[p]] up to child[start[p + 1]]
+    for (size_t e = 0; e < ctx->nedges; e++)
+        start[ctx->edges[e].parent + 2]++;
+    for (uint p = 2; p < n + 2; p++)
+        start[p] += start[p - 1];
+    for (size_t e = 0; e < ctx->nedges; e++)
+        child[start[ctx->edges[e].parent + 1]++] = ctx->edges[e].child;
 
+    // Each directory is queued once, by the first entry naming it
+    uint head = 0, tail = 0;
+    queue[tail++] = ROOTINO;
+    bit_set(seen, ROOTINO);
+    while (head < tail) {
+        uint dir = queue[head++];
+        PROGRESS_POS(head);
+        for (uint k = start[dir]; k < start[dir + 1]; k++) {
+            uint c = child[k];
+            if (c == ROOTINO)
+                return xerr_at(ctx, E_DIR_LOOP, dir, 0);
+            // A second name; CHK_REFS has reported it already if enabled
+            if (bit_test(seen, c))
+                return xerr_at(ctx, E_DIR_MULTI, c, 0);
+            if (ctx->inode_parent[c] != dir)
+                return xerr_at(ctx, E_PARENT_MISMATCH, c, 0);
+            bit_set(seen, c);
+            queue[tail++] = c;
+        }
+    }
 
-    // Allocate arrays
-    int *inode_used = calloc(num_inodes, sizeof(int));
-    int *inode_referenced = calloc(num_inodes, sizeof(int));
-    int *inode_type = calloc(num_inodes, sizeof(int));
-    int *inode_nlink = calloc(num_inodes, sizeof(int));
-    int *inode_linkcount = calloc(num_inodes, sizeof(int));
-    int *inode_parent = calloc(num_inodes, sizeof(int));
-    for (uint i = 0; i < num_inodes; i++) {
-        inode_parent[i] = -1;
+    // A directory the walk missed heads a subtree cut off from the root,
+    // or sits inside one: follow ".." up while it leads to another
+    // missed directory and report the top
+    for (uint inum = 1; inum < n; inum++) {
+        if (ctx->inode_type[inum] != T_DIR || bit_test(seen, inum))
+            continue;
+        uint top = inum;
+        for (uint steps = 0; steps < n; steps++) {
+            uint p = ctx->inode_parent[top];
+            if (p >= n || p == top || p == inum || ctx->inode_type[p] != T_DIR || bit_test(seen, p))
+                break;
+            top = p;
+        }
+        return xerr_at(ctx, E_DIR_UNREACHABLE, top, 0);
     }
+    return 0;
+}
 
-    int *block_used = calloc(num_blocks, sizeof(int));
-    int *block_type = calloc(num_blocks, sizeof(int));  // For distinguishing direct and indirect blocks
+// Check that the directories form one tree under the root: every one
+// reachable through entries from the root, named once, and with ".."
+// naming the directory it is reached from. Linear in inodes plus
+// entries.
+static int check_tree(struct xcheck *ctx) {
+    uint n = ctx->ninodes;
 
-    // Check reference counts for files and directories
-    for (uint inum = 1; inum < num_inodes; inum++) {
-        if (inode_used[inum]) {
-            if (inode_type[inum] == T_FILE) {
-                if (inode_nlink[inum] != inode_linkcount[inum]) {
-                    fprintf(stderr, "ERROR: bad reference count for file.\n");
-                    free(inode_used); free(inode_referenced); free(inode_type);
-                    free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                    free(block_used); free(block_type); close(fd);
-                    exit(1);
-                }
-            } else if (inode_type[inum] == T_DIR) {
-                // Check for multiple links to a directory
-                if (inum != ROOTINO && inode_linkcount[inum] > 1) {
-                    fprintf(stderr, "ERROR: directory appears more than once in file system.\n");
-                    free(inode_used); free(inode_referenced); free(inode_type);
-                    free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                    free(block_used); free(block_type); close(fd);
-                    exit(1);
-                }
-            }
+    if (n <= ROOTINO || ctx->inode_type[ROOTINO] != T_DIR)
+        return xerr(ctx, E_NO_ROOT);
+    // A resumed scan did not see the directories before where it
+    // picked up
+    for (uint inum = ctx->scan_first; ctx->resume_phase == PHASE_DIRS && inum < ctx->resume_pos; inum++) {
+        if (ctx->inode_type[inum] == T_DIR && each_dir_block(ctx, inum, edge_block) < 0)
+            return -1;
+    }
+
+    uint *start = calloc((size_t)n + 2, sizeof(uint));
+    uint *child = malloc((ctx->nedges + 1) * sizeof(uint));
+    uint *queue = malloc((ctx->nedges + 1) * sizeof(uint));
+    uint64_t *seen = calloc(((size_t)n + 63) / 64, sizeof(uint64_t));
+    int r;
+    if (start == NULL || child == NULL || queue == NULL || seen == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        r = -1;
+    } else {
+        r = walk_tree(ctx, start, child, queue, seen);
+    }
+    free(start);
+    free(child);
+    free(queue);
+    free(seen);
+    return r;
+}
+
+// Bits of the bitmap for blocks [base, base + 64); base is a multiple of
+// 64, so the word never straddles two bitmap blocks.
+static uint64_t bitmap_word(struct xcheck *ctx, uint base) {
+    const uchar *p = (const uchar *)img_block(ctx->img, ctx->bmapstart + base / BPB) + (base % BPB) / 8;
+    uint64_t w = 0;
+    for (int i = 7; i >= 0; i--)
+        w = (w << 8) | p[i];
+    return w;
+}
+
+// Mask of the bits in the word at base that fall in [data_start, size)
+static uint64_t data_mask(struct xcheck *ctx, uint base) {
+    uint64_t m = ~(uint64_t)0;
+    if (base < ctx->data_start)
+        m &= ctx->data_start - base >= 64 ? 0 : ~(uint64_t)0 << (ctx->data_start - base);
+    if (ctx->size - base < 64)
+        m &= ((uint64_t)1 << (ctx->size - base)) - 1;
+    return m;
+}
+
+// With --repair, plan every bitmap word that disagrees with the blocks
+// the inodes claimed
+static int repair_bitmap(struct xcheck *ctx) {
+    uint first = ctx->data_start & ~63U;
+
+    for (uint base = first; base < ctx->size; base += 64) {
+        if (base == first || base % BPB == 0) {
+            PROGRESS_POS(base);
+            COUNT(ctx->blocks_scanned);
         }
+        uint64_t mask = data_mask(ctx, base);
+        uint64_t was = bitmap_word(ctx, base);
+        uint64_t now = (was & ~mask) | (ctx->block_used[base / 64] & mask);
+        if (now == was)
+            continue;
+        if (was & ~now)
+            xrepair(ctx, E_BMAP_UNUSED);
+        if (now & ~was)
+            xrepair(ctx, E_ADDR_FREE);
+        if (repair_word(ctx->repair, base, was, now) < 0)
+            return -1;
     }
+    return 0;
+}
 
-    // Process inodes
-    for (uint inum = 0; inum < num_inodes; inum++) {
-        struct dinode *dip = get_inode(img_ptr, sb, inum);
+// Check the bitmap against the blocks the inodes claimed, 64 blocks at a
+// time
+static int check_bitmap(struct xcheck *ctx) {
+    struct image *img = ctx->img;
+    uint first = ctx->data_start & ~63U;
 
-        int type = xshort(dip->type);
+    if (ctx->repair)
+        return repair_bitmap(ctx);
 
-        // Check 1: Each inode is either unallocated or one of the valid types
-        if (type != 0 && type != T_FILE && type != T_DIR && type != T_DEV) {
-            fprintf(stderr, "ERROR: bad inode.\n");
-            free(inode_used); free(inode_referenced); free(inode_type);
-            free(inode_nlink); free(inode_linkcount); free(inode_parent);
-            free(block_used); free(block_type); close(fd);
-            exit(1);
-        }
-
-        if (type != 0) {
-            inode_used[inum] = 1;
-            inode_type[inum] = type;
-            inode_nlink[inum] = xshort(dip->nlink);
-
-            // Process direct blocks
-            for (int i = 0; i < NDIRECT; i++) {
-                uint addr = xint(dip->addrs[i]);
-                if (addr != 0) {
-                    if (addr < data_block_start || addr >= sb->size) {
-                        fprintf(stderr, "ERROR: bad direct address in inode.\n");
-                        free(inode_used); free(inode_referenced); free(inode_type);
-                        free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                        free(block_used); free(block_type); close(fd);
-                        exit(1);
-                    }
-                    if (block_used[addr]) {
-                        if (block_type[addr] == DIRECT) {
-                            fprintf(stderr, "ERROR: direct address used more than once.\n");
-                        } else {
-                            fprintf(stderr, "ERROR: indirect address used more than once.\n");
-                        }
-                        free(inode_used); free(inode_referenced); free(inode_type);
-                        free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                        free(block_used); free(block_type); close(fd);
-                        exit(1);
-                    }
-                    block_used[addr] = 1;
-                    block_type[addr] = DIRECT;
-                    // Check that block is marked in bitmap
-                    if (!block_is_marked(img_ptr, sb, addr)) {
-                        fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-                        free(inode_used); free(inode_referenced); free(inode_type);
-                        free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                        free(block_used); free(block_type); close(fd);
-                        exit(1);
-                    }
-                }
-            }
+    // Check for bitmap marks block in use but it is not in use
+    for (uint base = first; base < ctx->size; base += 64) {
+        // A bitmap block in a hole marks nothing in use
+        if ((base == first || base % BPB == 0) && img_is_hole(img, ctx->bmapstart + base / BPB)) {
+            base = (base / BPB + 1) * BPB - 64;
+            continue;
+        }
+        if (base == first || base % BPB == 0) {
+            PROGRESS_POS(base);
+            COUNT(ctx->blocks_scanned);
+        }
+        uint64_t marked = bitmap_word(ctx, base) & data_mask(ctx, base);
+        if (marked & ~ctx->block_used[base / 64])
+            return xerr_at(ctx, E_BMAP_UNUSED, 0, base + __builtin_ctzll(marked & ~ctx->block_used[base / 64]));
+    }
 
-            // Process indirect block
-            uint indirect_addr = xint(dip->addrs[NDIRECT]);
-            if (indirect_addr != 0) {
-                if (indirect_addr < data_block_start || indirect_addr >= sb->size) {
-                    fprintf(stderr, "ERROR: bad indirect address in inode.\n");
-                    free(inode_used); free(inode_referenced); free(inode_type);
-                    free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                    free(block_used); free(block_type); close(fd);
-                    exit(1);
-                }
-                if (block_used[indirect_addr]) {
-                    if (block_type[indirect_addr] == DIRECT) {
-                        fprintf(stderr, "ERROR: direct address used more than once.\n");
-                    } else {
-                        fprintf(stderr, "ERROR: indirect address used more than once.\n");
-                    }
-                    free(inode_used); free(inode_referenced); free(inode_type);
-                    free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                    free(block_used); free(block_type); close(fd);
-                    exit(1);
-                }
-                block_used[indirect_addr] = 1;
-                block_type[indirect_addr] = INDIRECT;
-                // Check that block is marked in bitmap
-                if (!block_is_marked(img_ptr, sb, indirect_addr)) {
-                    fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-                    free(inode_used); free(inode_referenced); free(inode_type);
-                    free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                    free(block_used); free(block_type); close(fd);
-                    exit(1);
-                }
+    // Check if blocks are used by an inode but marked as free in the bitmap
+    for (uint base = first; base < ctx->size; base += 64) {
+        uint64_t used = ctx->block_used[base / 64] & data_mask(ctx, base);
+        if (used && (used & ~bitmap_word(ctx, base)))
+            return xerr_at(ctx, E_ADDR_FREE, 0, base + __builtin_ctzll(used & ~bitmap_word(ctx, base)));
+    }
+    return 0;
+}
 
-                // Read indirect block
-                uint *indirect_block = (uint *)(img_ptr + indirect_addr * BSIZE);
-                for (uint i = 0; i < NINDIRECT; i++) {
-                    uint addr = xint(indirect_block[i]);
-                    if (addr != 0) {
-                        if (addr < data_block_start || addr >= sb->size) {
-                            fprintf(stderr, "ERROR: bad indirect address in inode.\n");
-                            free(inode_used); free(inode_referenced); free(inode_type);
-                            free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                            free(block_used); free(block_type); close(fd);
-                            exit(1);
-                        }
-                        if (block_used[addr]) {
-                            if (block_type[addr] == DIRECT) {
-                                fprintf(stderr, "ERROR: direct address used more than once.\n");
-                            } else {
-                                fprintf(stderr, "ERROR: indirect address used more than once.\n");
-                            }
-                            free(inode_used); free(inode_referenced); free(inode_type);
-                            free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                            free(block_used); free(block_type); close(fd);
-                            exit(1);
-                        }
-                        block_used[addr] = 1;
-                        block_type[addr] = INDIRECT;
-                        // Check that block is marked in bitmap
-                        if (!block_is_marked(img_ptr, sb, addr)) {
-                            fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-                            free(inode_used); free(inode_referenced); free(inode_type);
-                            free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                            free(block_used); free(block_type); close(fd);
-                            exit(1);
-                        }
-                    }
-                }
+// Count the free data blocks in the bitmap for --usage, and their runs
+// for --frag-report. The check has just read the bitmap, so this pass
+// does not go back to the disk.
+static void scan_space(struct xcheck *ctx) {
+    uint64_t run = 0, ndata = 0, nfree = 0;
+
+    for (uint base = ctx->data_start & ~63U; base < ctx->size; base += 64) {
+        uint64_t mask = data_mask(ctx, base);
+        uint64_t free = ~bitmap_word(ctx, base) & mask;
+        ndata += __builtin_popcountll(mask);
+        nfree += __builtin_popcountll(free);
+        if (!ctx->frag)
+            continue;
+        if (mask == ~(uint64_t)0 && (free == 0 || free == mask)) {
+            if (free) {
+                run += 64;
+            } else if (run) {
+                frag_free_run(ctx->frag, run);
+                run = 0;
             }
+            continue;
         }
+        for (int i = 0; i < 64; i++) {
+            if (!((mask >> i) & 1))
+                continue;
+            if ((free >> i) & 1) {
+                run++;
+            } else if (run) {
+                frag_free_run(ctx->frag, run);
+                run = 0;
+            }
+        }
+    }
+    if (run)
+        frag_free_run(ctx->frag, run);
+    if (ctx->usage) {
+        ctx->usage->data_used = ndata - nfree;
+        ctx->usage->data_free = nfree;
     }
+}
 
-    // Check if root inode is allocated
-    if (!inode_used[ROOTINO]) {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        free(inode_used); free(inode_referenced); free(inode_type);
-        free(inode_nlink); free(inode_linkcount); free(inode_parent);
-        free(block_used); free(block_type); close(fd);
-        exit(1);
+// Add the names in directory block fbn of dir, at addr, without checking
+// them
+static int name_block(struct xcheck *ctx, uint addr, uint dir, uint fbn) {
+    if (!valid_addr(ctx, addr) || img_is_hole(ctx->img, addr))
+        return 0;
+    const struct dirent *de = img_block(ctx->img, addr);
+    for (uint i = 0; i < BSIZE / sizeof(struct dirent); i++) {
+        uint ref = xshort(de[i].inum);
+        if (ref == 0 || ref >= ctx->ninodes || strncmp(de[i].name, ".", DIRSIZ) == 0 ||
+            strncmp(de[i].name, "..", DIRSIZ) == 0)
+            continue;
+        if (ctx_add_name(ctx, dir, ref, de[i].name, fbn * DPB + i) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// The check stopped before the directory scan had named everything.
+// Carry on from the directory it was in, reading only names, so the
+// error can still be placed.
+static void finish_names(struct xcheck *ctx) {
+    ctx_drop_names(ctx, ctx->names_done);
+    for (uint inum = ctx->names_next; inum < ctx->ninodes; inum++) {
+        if (xshort(get_inode(ctx, inum)->type) == T_DIR && each_dir_block(ctx, inum, name_block) < 0)
+            break;
     }
+    ctx->names_next = ctx->ninodes;
+    ctx->names_done = ctx->nnames;
+}
 
-    // Process directories
-    for (uint inum = 0; inum < num_inodes; inum++) {
-        if (inode_used[inum] && inode_type[inum] == T_DIR) {
-            struct dinode *dip = get_inode(img_ptr, sb, inum);
+// Print one detail line under an error, prefixed like the error
+static void xdetail(struct xcheck *ctx, const char *fmt, ...) {
+    va_list ap;
 
-            int dot_found = 0;
-            int dotdot_found = 0;
+    if (ctx->batch)
+        fprintf(stderr, "%s: ", ctx->name);
+    fputs("  ", stderr);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
 
-            // Process direct blocks
-            for (int i = 0; i < NDIRECT; i++) {
-                uint addr = xint(dip->addrs[i]);
-                if (addr != 0) {
-                    process_directory_block(img_ptr, addr, inum, &dot_found, &dotdot_found, inode_referenced, inode_type, inode_used, inode_linkcount, inode_parent, num_inodes);
-                }
-            }
+// Print the detail lines for the last error: the inode, the block and
+// every path (up to a limit) the inode is known by.
+static void print_detail(struct xcheck *ctx) {
+    struct err_detail *d = &ctx->detail;
+    char path[4096];
 
-            // Process indirect block
-            uint indirect_addr = xint(dip->addrs[NDIRECT]);
-            if (indirect_addr != 0) {
-                uint *indirect_block = (uint *)(img_ptr + indirect_addr * BSIZE);
-                for (uint i = 0; i < NINDIRECT; i++) {
-                    uint addr = xint(indirect_block[i]);
-                    if (addr != 0) {
-                        process_directory_block(img_ptr, addr, inum, &dot_found, &dotdot_found, inode_referenced, inode_type, inode_used, inode_linkcount, inode_parent, num_inodes);
-                    }
-                }
-            }
+    if (d->inum == 0 && d->block == 0)
+        return;
+    if (ctx->names_next < ctx->ninodes)
+        finish_names(ctx);
 
-            if (!dot_found || !dotdot_found) {
-                fprintf(stderr, "ERROR: directory not properly formatted.\n");
-                free(inode_used); free(inode_referenced); free(inode_type);
-                free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                free(block_used); free(block_type); close(fd);
-                exit(1);
-            }
+    if (d->dir) {
+        // A bad entry: say where the entry is
+        if (d->dir == ROOTINO)
+            path[0] = '\0';
+        else if (d->dir < ctx->ninodes && ctx->inode_name[d->dir])
+            ctx_path(ctx, &ctx->names[ctx->inode_name[d->dir] - 1], path, sizeof(path));
+        else
+            snprintf(path, sizeof(path), "?");
+        xdetail(ctx, "entry %s/%s names inode %u", path, d->name, d->inum);
+        return;
+    }
+    if (d->block)
+        xdetail(ctx, "block %u", d->block);
+    if (d->inum == 0)
+        return;
+    if (d->inum == ROOTINO) {
+        xdetail(ctx, "inode %u at /", d->inum);
+        return;
+    }
 
-            // For root directory, check that parent is itself
-            if (inum == ROOTINO && inode_parent[inum] != ROOTINO) {
-                fprintf(stderr, "ERROR: root directory does not exist.\n");
-                free(inode_used); free(inode_referenced); free(inode_type);
-                free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                free(block_used); free(block_type); close(fd);
-                exit(1);
-            }
+    uint shown = 0;
+    for (uint e = d->inum < ctx->ninodes ? ctx->inode_name[d->inum] : 0; e; e = ctx->names[e - 1].next) {
+        if (shown++ == 8) {
+            xdetail(ctx, "inode %u has more names", d->inum);
+            break;
         }
+        ctx_path(ctx, &ctx->names[e - 1], path, sizeof(path));
+        xdetail(ctx, "inode %u at %s", d->inum, path);
     }
+    if (shown == 0)
+        xdetail(ctx, "inode %u is not in any directory", d->inum);
+}
 
-    // Check for inodes marked in use but not found in a directory
-    for (uint inum = 1; inum < num_inodes; inum++) {
-        if (inode_used[inum] && !inode_referenced[inum] && inode_type[inum] != T_DIR) {
-            fprintf(stderr, "ERROR: inode marked use but not found in a directory.\n");
-            free(inode_used); free(inode_referenced); free(inode_type);
-            free(inode_nlink); free(inode_linkcount); free(inode_parent);
-            free(block_used); free(block_type); close(fd);
-            exit(1);
+// Write the name table to a --name-index file, finishing it first if
+// the check stopped before the directory scan did
+static int write_names(struct xcheck *ctx, const char *path, const struct superblock *sb) {
+    struct name_index nx;
+
+    if (ctx->names_next < ctx->ninodes)
+        finish_names(ctx);
+    if (names_create(&nx, path, sb, ctx->img->size, ctx->nnames) < 0)
+        return -1;
+    for (size_t i = 0; i < ctx->nnames; i++)
+        names_add(&nx, ctx->names[i].parent, ctx->names[i].child, ctx->names[i].name, ctx->names[i].pos);
+    return names_commit(&nx);
+}
+
+// Items each phase walks, for progress reporting
+static uint64_t phase_items(struct xcheck *ctx, enum phase ph) {
+    switch (ph) {
+    case PHASE_INODES:
+    case PHASE_DIRS:
+    case PHASE_LINKS:
+        return ctx->ninodes;
+    case PHASE_TREE:
+        return ctx->nedges + 1;
+    case PHASE_BITMAP:
+    case PHASE_SCRUB:
+        return ctx->size;
+    default:
+        return 0;
+    }
+}
+
+static void phase_begin(struct xcheck *ctx, enum phase ph) {
+    XTRACE2(phase__start, ph, phase_names[ph]);
+    progress_phase(ctx->name, ph, phase_items(ctx, ph));
+    stats_begin(ph);
+}
+
+static void phase_end(enum phase ph) {
+    stats_end(ph);
+    XTRACE2(phase__end, ph, phase_names[ph]);
+}
+
+static int run_phase(struct xcheck *ctx, enum phase ph, int (*check)(struct xcheck *)) {
+    phase_begin(ctx, ph);
+    int r = check(ctx);
+    phase_end(ph);
+    return r;
+}
+
+// How main() asked for each image to be checked
+struct options {
+    int img_flags;
+    int checkpoint;         // Checkpointing to the --checkpoint file
+    int resume;
+    const char *shard;      // --shard range, or NULL
+    const char *shard_out;  // Where a shard run writes its result
+    const char *owner_index; // --owner-index file, or NULL
+    const char *name_index; // --name-index file, or NULL
+    int paths;              // Print error details (--paths)
+    int frag;               // Print a fragmentation report (--frag-report)
+    int usage;              // Print space usage (--usage)
+    const char *scrub;      // --scrub checksum store, or NULL
+    const char *scrub_write; // --scrub-write checksum store, or NULL
+    int scrub_threads;      // 0: one per CPU
+    int repair;             // Fix the bitmap and link counts (--repair)
+    int dry_run;            // Only print the fixes (--dry-run)
+};
+
+// Open path and lay out ctx for it, starting the open phase. Returns
+// -2 if the image could not be opened, with the phase ended. Otherwise
+// sb_copy holds the superblock and the caller ends the phase and closes
+// the image; -1 means the superblock was rejected.
+static int open_image(struct xcheck *ctx, struct image *image, const char *path, int img_flags,
+                      struct superblock *sb_copy) {
+    int r = -1;
+
+    ctx->name = path;
+    phase_begin(ctx, PHASE_OPEN);
+    if (img_open(image, path, img_flags) < 0) {
+        phase_end(PHASE_OPEN);
+        metrics_image(path, NULL, 0);
+        return -2;
+    }
+
+    *sb_copy = *(const struct superblock *)img_block(image, 1);
+    if (img_sb(image))
+        r = ctx_reset(ctx, image);
+    return r;
+}
+
+// Limit the scans to a shard given as START:END (inode blocks, END
+// exclusive and optional) or K/N (the K-th of N equal parts, from 0).
+static int set_shard(struct xcheck *ctx, const char *spec) {
+    uint nblocks = (ctx->ninodes + IPB - 1) / IPB;
+    unsigned long long a, b = nblocks;
+    char sep;
+    int n = sscanf(spec, "%llu%c%llu", &a, &sep, &b);
+
+    if (n >= 2 && sep == '/' && n == 3 && b > 0 && a < b) {
+        unsigned long long k = a;
+        a = k * nblocks / b;
+        b = (k + 1) * nblocks / b;
+    } else if (n < 2 || sep != ':') {
+        a = b = 0;
+    }
+    if (a >= b || b > nblocks) {
+        fprintf(stderr, "Error: bad shard %s; the inode table has %u blocks.\n", spec, nblocks);
+        return -1;
+    }
+    ctx->scan_first = a * IPB;
+    ctx->scan_end = b * IPB < ctx->ninodes ? b * IPB : ctx->ninodes;
+    ctx->sharded = 1;
+    return 0;
+}
+
+// What block bno of a file system laid out as sb holds
+static const char *block_kind(const struct superblock *sb, uint bno) {
+    if (bno == 0)
+        return "boot block";
+    if (bno == 1)
+        return "superblock";
+    if (bno >= sb->logstart && bno < sb->logstart + sb->nlog)
+        return "log";
+    if (bno >= sb->inodestart && bno < sb->bmapstart)
+        return "inode table";
+    if (bno >= sb->bmapstart && bno < sb->bmapstart + (sb->size + BPB - 1) / BPB)
+        return "bitmap";
+    return "data";
+}
+
+// Write the checksums of a consistent image to --scrub-write, or
+// compare them with --scrub and report the blocks that changed
+static int scrub_image(struct xcheck *ctx, const struct options *opt, const struct superblock *sb) {
+    struct scrub_store ss;
+    struct scrub_result res;
+    int write = opt->scrub_write != NULL;
+
+    if (write ? scrub_create(&ss, opt->scrub_write, sb, ctx->img->size) < 0 : scrub_load(&ss, opt->scrub) < 0)
+        return -1;
+    int r = scrub_run(ctx->img, &ss, write, opt->scrub_threads, &res);
+    if (write && r == 0)
+        r = scrub_commit(&ss);
+    else if (write)
+        scrub_abort(&ss);
+    else
+        scrub_unload(&ss);
+    if (r < 0)
+        return -1;
+    ctx->blocks_scanned += res.checked;
+
+    double mbps = res.secs > 0 ? res.checked * (double)BSIZE / 1e6 / res.secs : 0;
+    if (write) {
+        printf("%s: %llu block checksums written in %.2f s (%.1f MB/s)\n", ctx->name,
+               (unsigned long long)res.checked, res.secs, mbps);
+        return 0;
+    }
+    uint first = 0, shown = 0;
+    for (uint w = 0; w < (ctx->size + 63) / 64; w++) {
+        for (uint64_t bits = res.changed_map[w]; bits; bits &= bits - 1) {
+            uint bno = w * 64 + __builtin_ctzll(bits);
+            if (shown == 0)
+                first = bno;
+            if (shown++ < 100)
+                printf("%s: block %u (%s) changed\n", ctx->name, bno, block_kind(sb, bno));
         }
     }
+    if (shown > 100)
+        printf("%s: %u more changed blocks\n", ctx->name, shown - 100);
+    printf("%s: %llu blocks scrubbed in %.2f s (%.1f MB/s): %llu changed, %llu not in the store, "
+           "%llu freed since\n", ctx->name, (unsigned long long)res.checked, res.secs, mbps,
+           (unsigned long long)res.changed, (unsigned long long)res.added, (unsigned long long)res.dropped);
+    free(res.changed_map);
+    return res.changed ? xerr_at(ctx, E_SCRUB_CHANGED, 0, first) : 0;
+}
 
-    // Check reference counts for files and directories
-    for (uint inum = 1; inum < num_inodes; inum++) {
-        if (inode_used[inum]) {
-            if (inode_type[inum] == T_FILE) {
-                if (inode_nlink[inum] != inode_linkcount[inum]) {
-                    fprintf(stderr, "ERROR: bad reference count for file.\n");
-                    free(inode_used); free(inode_referenced); free(inode_type);
-                    free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                    free(block_used); free(block_type); close(fd);
-                    exit(1);
-                }
-            } else if (inode_type[inum] == T_DIR) {
-                if (inode_linkcount[inum] > 1 && inum != ROOTINO) {
-                    fprintf(stderr, "ERROR: directory appears more than once in file system.\n");
-                    free(inode_used); free(inode_referenced); free(inode_type);
-                    free(inode_nlink); free(inode_linkcount); free(inode_parent);
-                    free(block_used); free(block_type); close(fd);
-                    exit(1);
+// Check one image with a context that may have checked others before.
+// Returns 0 if the image is consistent.
+static int check_image(struct xcheck *ctx, const char *path, const struct options *opt) {
+    struct image image;
+    struct superblock sb_copy;
+
+    int r = open_image(ctx, &image, path, opt->img_flags, &sb_copy);
+    if (r == -2)
+        return -1;
+    if (r == 0 && opt->shard && set_shard(ctx, opt->shard) < 0)
+        r = -1;
+    // Both read or write every block in place
+    if (r == 0 && image.gz && (opt->scrub || opt->scrub_write || opt->repair)) {
+        fprintf(stderr, "Error: %s is compressed; --scrub and --repair need it decompressed.\n", path);
+        r = -1;
+    }
+    if (r == 0 && opt->resume && ckpt_resume(ctx) < 0)
+        r = -1;
+    struct owner_index owners = {.fd = -1};
+    if (r == 0 && opt->owner_index) {
+        r = owner_create(&owners, opt->owner_index, &sb_copy, image.size);
+        ctx->block_owner = owners.rec;
+    }
+    struct frag frag;
+    if (r == 0 && opt->frag) {
+        memset(&frag, 0, sizeof(frag));
+        ctx->frag = &frag;
+    }
+    struct usage space;
+    if (r == 0 && opt->usage) {
+        r = usage_init(&space, ctx->ninodes);
+        if (r == 0)
+            ctx->usage = &space;
+    }
+    struct repair fixes = {0};
+    if (r == 0 && opt->repair)
+        ctx->repair = &fixes;
+    phase_end(PHASE_OPEN);
+    int opened = r == 0;
+
+    // A resumed check skips the phases the checkpoint had finished
+    int c = ctx->checks;
+    if (opt->checkpoint)
+        ckpt_arm(1);
+    if (r == 0 && ctx->resume_phase <= PHASE_INODES)
+        r = run_phase(ctx, PHASE_INODES, check_inodes);
+    int scanned = r == 0;
+    // The index is kept even if the scan stopped at an error; it says
+    // so, and the blocks seen so far are still worth looking up
+    if (ctx->block_owner) {
+        if (owner_commit(&owners, r == 0) < 0)
+            r = -1;
+        ctx->block_owner = NULL;
+    }
+    if (r == 0 && NEED_DIR_SCAN(c))
+        r = run_phase(ctx, PHASE_DIRS, check_dirs);
+    if (opt->checkpoint)
+        ckpt_arm(0);
+    // A block that could not be read was checked as zeros, which look
+    // like free inodes and empty directories; nothing after can be trusted
+    if (image.io_error) {
+        fprintf(stderr, "Error: %s could not be read in full.\n", path);
+        r = -1;
+    }
+
+    // The rest needs every shard; a shard run hands over what it found,
+    // errors included, to --merge
+    if (ctx->sharded) {
+        if (opened && !image.io_error && shard_write(ctx, opt->shard_out) < 0)
+            r = -1;
+    } else {
+        if (r == 0 && NEED_REFS(c))
+            r = run_phase(ctx, PHASE_LINKS, check_links);
+        if (r == 0 && (c & CHK_TREE))
+            r = run_phase(ctx, PHASE_TREE, check_tree);
+        if (r == 0 && (c & CHK_BITMAP))
+            r = run_phase(ctx, PHASE_BITMAP, check_bitmap);
+        // Fixes are only written if nothing else is wrong; a dry run
+        // leaves the image as inconsistent as it was
+        if (r == 0 && ctx->repair && (fixes.nwords || fixes.nlinks)) {
+            r = repair_apply(stdout, path, &sb_copy, &fixes, opt->dry_run);
+            if (opt->dry_run)
+                r = -1;
+        }
+        // Checksums are only written for an image that passed
+        if (r == 0 && (opt->scrub || opt->scrub_write)) {
+            phase_begin(ctx, PHASE_SCRUB);
+            r = scrub_image(ctx, opt, &sb_copy);
+            phase_end(PHASE_SCRUB);
+        }
+    }
+
+    if (r < 0 && opened && opt->paths)
+        print_detail(ctx);
+    if (ctx->frag || ctx->usage)
+        scan_space(ctx);
+    if (ctx->frag) {
+        frag_report(stdout, path, ctx->frag, !scanned);
+        ctx->frag = NULL;
+    }
+    if (ctx->usage) {
+        if (ctx->names_next < ctx->ninodes)
+            finish_names(ctx);
+        usage_report(stdout, ctx, ctx->usage, !scanned);
+        usage_free(ctx->usage);
+        ctx->usage = NULL;
+    }
+    if (opened && opt->name_index && write_names(ctx, opt->name_index, &sb_copy) < 0)
+        r = -1;
+    if (ctx->repair) {
+        repair_free(ctx->repair);
+        ctx->repair = NULL;
+    }
+    if (opt->checkpoint)
+        ckpt_finish();
+    metrics_image(path, &sb_copy, r == 0);
+    img_close(&image);
+    ctx->img = NULL;
+    ctx->sharded = 0;
+    return r;
+}
+
+static int shard_cmp(const void *a, const void *b) {
+    const struct shard *x = a, *y = b;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+// Load the shards in inode order: their inode arrays, and their block
+// bitsets merged into ours. A block two shards claim is a duplicate.
+static int merge_blocks(struct xcheck *ctx, struct shard *sh, int n) {
+    size_t words = NEED_BLOCK_MAPS(ctx->checks) ? ((size_t)ctx->size + 63) / 64 : 0;
+    uint64_t *used = NULL, *indirect = NULL;
+    int r = 0;
+
+    if (words) {
+        used = malloc(words * sizeof(uint64_t));
+        indirect = malloc(words * sizeof(uint64_t));
+        if (used == NULL || indirect == NULL) {
+            fprintf(stderr, "Error: out of memory.\n");
+            r = -1;
+        }
+    }
+    for (int i = 0; i < n && r == 0; i++) {
+        PROGRESS_POS(sh[i].first);
+        if (shard_load(ctx, &sh[i], used, indirect) < 0) {
+            r = -1;
+            break;
+        }
+        shard_close(&sh[i]);
+        for (size_t w = 0; w < words; w++) {
+            uint64_t both = ctx->block_used[w] & used[w];
+            if (both && (ctx->checks & CHK_DUPS)) {
+                r = xerr(ctx, (ctx->block_indirect[w] & both) ? E_DUP_INDIRECT : E_DUP_DIRECT);
+                break;
+            }
+            ctx->block_used[w] |= used[w];
+            ctx->block_indirect[w] |= indirect[w];
+        }
+    }
+    free(used);
+    free(indirect);
+
+    if (r == 0 && (ctx->checks & CHK_DIRS) && (ctx->ninodes <= ROOTINO || !ctx->inode_type[ROOTINO]))
+        r = xerr(ctx, E_NO_ROOT);
+    return r;
+}
+
+// Resolve the directory entries the shards recorded
+static int merge_refs(struct xcheck *ctx, struct shard *sh, int n) {
+    struct edge buf[4096];
+
+    for (int i = 0; i < n; i++) {
+        PROGRESS_POS(sh[i].first);
+        if (shard_seek_edges(&sh[i]) < 0)
+            return -1;
+        uint64_t left = sh[i].nedges;
+        while (left > 0) {
+            size_t got = shard_edges(&sh[i], buf, left < 4096 ? left : 4096);
+            if (got == 0) {
+                fprintf(stderr, "Error: shard %s is truncated.\n", sh[i].path);
+                return -1;
+            }
+            for (size_t j = 0; j < got; j++) {
+                uint child = buf[j].child;
+                if (child >= ctx->ninodes || !ctx->inode_type[child]) {
+                    if (ctx->checks & CHK_REACH)
+                        return xerr(ctx, E_INODE_FREE_REF);
+                    continue;
                 }
+                if (buf[j].parent && ctx->inode_refs)
+                    ctx->inode_refs[child]++;
+                if (buf[j].parent && (ctx->checks & CHK_TREE) && ctx->inode_type[child] == T_DIR &&
+                    ctx_add_edge(ctx, buf[j].parent, child) < 0)
+                    return -1;
             }
+            left -= got;
         }
+        shard_close(&sh[i]);
     }
+    return 0;
+}
 
-    // Check for bitmap marks block in use but it is not in use
-    for (uint blocknum = data_block_start; blocknum < sb->size; blocknum++) {
-        if (block_is_marked(img_ptr, sb, blocknum) && !block_used[blocknum]) {
-            fprintf(stderr, "ERROR: bitmap marks block in use but it is not in use.\n");
-            free(inode_used); free(inode_referenced); free(inode_type);
-            free(inode_nlink); free(inode_linkcount); free(inode_parent);
-            free(block_used); free(block_type); close(fd);
-            exit(1);
+// Combine the results of --shard runs on path and run the checks that
+// span shards: duplicates, the root, references, reference counts, the
+// directory tree and the bitmap. Returns 0 if the image is consistent.
+static int merge_image(struct xcheck *ctx, const char *path, char **paths, int n, int img_flags) {
+    struct image image;
+    struct superblock sb_copy;
+    struct shard *sh = NULL;
+
+    int r = open_image(ctx, &image, path, img_flags, &sb_copy);
+    if (r == -2)
+        return -1;
+    if (r == 0 && (sh = calloc(n, sizeof(*sh))) == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        r = -1;
+    }
+    for (int i = 0; i < n && r == 0; i++)
+        r = shard_open(ctx, &sh[i], paths[i]);
+    if (r == 0) {
+        qsort(sh, n, sizeof(*sh), shard_cmp);
+        for (int i = 0; i < n && r == 0; i++) {
+            if (sh[i].first != (i ? sh[i - 1].end : 0) || (i == n - 1 && sh[i].end != ctx->ninodes)) {
+                fprintf(stderr, "Error: shards do not cover the inode table exactly once.\n");
+                r = -1;
+            }
         }
     }
+    phase_end(PHASE_OPEN);
 
-    // Check if blocks are used by an inode but marked as free in the bitmap
-    for (uint blocknum = data_block_start; blocknum < sb->size; blocknum++) {
-        if (block_used[blocknum] && !block_is_marked(img_ptr, sb, blocknum)) {
-            fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-            free(inode_used); free(inode_referenced); free(inode_type);
-            free(inode_nlink); free(inode_linkcount); free(inode_parent);
-            free(block_used); free(block_type); close(fd);
-            exit(1);
+    // Errors a shard run found, possibly on another machine. Reported
+    // again here, once per kind, with their full counts.
+    int shard_errors = 0;
+    for (int i = 0; i < n && r == 0; i++) {
+        ctx->inodes_scanned += sh[i].inodes_scanned;
+        ctx->blocks_scanned += sh[i].blocks_scanned;
+    }
+    for (int e = 0; e < NERRORS && r == 0; e++) {
+        uint count = 0;
+        for (int i = 0; i < n; i++)
+            count += sh[i].errors[e];
+        if (count) {
+            ctx->errors[e] += count - 1;
+            xerr(ctx, e);
+            shard_errors = 1;
+        }
+    }
+    if (shard_errors)
+        r = -1;
+
+    int c = ctx->checks;
+    if (r == 0) {
+        phase_begin(ctx, PHASE_INODES);
+        r = merge_blocks(ctx, sh, n);
+        phase_end(PHASE_INODES);
+    }
+    if (r == 0 && NEED_EDGES(c)) {
+        phase_begin(ctx, PHASE_DIRS);
+        r = merge_refs(ctx, sh, n);
+        phase_end(PHASE_DIRS);
+    }
+    if (r == 0 && NEED_REFS(c))
+        r = run_phase(ctx, PHASE_LINKS, check_links);
+    if (r == 0 && (c & CHK_TREE))
+        r = run_phase(ctx, PHASE_TREE, check_tree);
+    if (r == 0 && (c & CHK_BITMAP))
+        r = run_phase(ctx, PHASE_BITMAP, check_bitmap);
+
+    for (int i = 0; sh && i < n; i++)
+        shard_close(&sh[i]);
+    free(sh);
+    metrics_image(path, &sb_copy, r == 0);
+    img_close(&image);
+    ctx->img = NULL;
+    return r;
+}
+
+// Check families and profiles accepted by --checks
+static const struct {
+    const char *name;
+    int checks;
+} check_names[] = {
+    {"types", CHK_TYPES},
+    {"addrs", CHK_ADDRS},
+    {"dups", CHK_DUPS},
+    {"bitmap", CHK_BITMAP},
+    {"dirs", CHK_DIRS},
+    {"reach", CHK_REACH},
+    {"refs", CHK_REFS},
+    {"tree", CHK_TREE},
+    {"full", CHK_ALL},
+    {"bitmap-only", CHK_BITMAP},
+    {"structure-only", CHK_TYPES | CHK_DIRS | CHK_REACH | CHK_REFS | CHK_TREE},
+};
+
+// Parse a comma-separated --checks list into CHK_* flags.
+static int parse_checks(char *arg, int *checks) {
+    *checks = 0;
+    for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        size_t i;
+        for (i = 0; i < sizeof(check_names) / sizeof(check_names[0]); i++) {
+            if (strcmp(tok, check_names[i].name) == 0)
+                break;
         }
+        if (i == sizeof(check_names) / sizeof(check_names[0]))
+            return -1;
+        *checks |= check_names[i].checks;
+    }
+    return *checks ? 0 : -1;
+}
+
+// Parse a comma-separated --map list into image flags.
+static int parse_map_modes(char *arg, int *flags) {
+    for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        if (strcmp(tok, "plain") == 0)
+            *flags |= IMG_NOADVISE;
+        else if (strcmp(tok, "advise") == 0)
+            *flags &= ~IMG_NOADVISE;
+        else if (strcmp(tok, "populate") == 0)
+            *flags |= IMG_POPULATE;
+        else if (strcmp(tok, "huge") == 0)
+            *flags |= IMG_HUGEPAGE;
+        else
+            return -1;
     }
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: xcheck [options] <file_system_image>...\n"
+                    "       xcheck [options] --merge <file_system_image> <shard>...\n"
+                    "  -c, --checks=LIST  run only these check families, comma-separated:\n"
+                    "                     types addrs dups bitmap dirs reach refs tree, or a\n"
+                    "                     profile: full (default) bitmap-only structure-only\n"
+                    "  -C, --checkpoint=PATH\n"
+                    "                     save the scan state to PATH periodically and on\n"
+                    "                     SIGTERM or SIGINT (one image only)\n"
+                    "  -F, --frag-report  print extents per file, seek distances, indirect\n"
+                    "                     block placement and free space spread\n"
+                    "  -I, --checkpoint-interval=SECS\n"
+                    "                     seconds between checkpoints, at least 1 (default 60)\n"
+                    "  -d, --direct       read through O_DIRECT, bypassing the page cache\n"
+                    "  -x, --shard=RANGE  scan only inode blocks START:END (END exclusive) or\n"
+                    "                     the K-th of N equal parts, K/N, and write the\n"
+                    "                     partial result to --shard-out (one image only)\n"
+                    "  -o, --shard-out=PATH\n"
+                    "                     where a shard run writes its result\n"
+                    "  -X, --merge        merge shard results: xcheck --merge IMAGE SHARD...\n"
+                    "  -m, --map=MODES    mapping strategy, comma-separated:\n"
+                    "                     plain     no access-pattern hints\n"
+                    "                     advise    per-region madvise hints (default)\n"
+                    "                     populate  prefault the mapping and state arrays\n"
+                    "                     huge      transparent huge pages for both\n"
+                    "  -n, --paths        after an error, print the inode and block it concerns\n"
+                    "                     and the paths the inode is known by\n"
+                    "  -N, --name-index=PATH\n"
+                    "                     write the path lookup index used by xls -i\n"
+                    "                     (one image only)\n"
+                    "  -O, --owner-index=PATH\n"
+                    "                     write the block-to-inode index queried by xowner\n"
+                    "                     (one image only)\n"
+                    "  -M, --metrics-file=PATH\n"
+                    "                     write Prometheus textfile-collector metrics to PATH\n"
+                    "  -P, --progress[=SECS]\n"
+                    "                     report phase, counts, throughput and ETA every\n"
+                    "                     SECS seconds (default 5) on stderr\n"
+                    "  -S, --status-file=PATH\n"
+                    "                     write the progress report to PATH instead\n"
+                    "  -u, --usage        print inode and block usage, bytes per file type,\n"
+                    "                     the largest files and directory subtrees\n"
+                    "  -k, --scrub=PATH   after the checks, compare every allocated block with\n"
+                    "                     the checksums in PATH (one image only)\n"
+                    "  -K, --scrub-write=PATH\n"
+                    "                     if the checks pass, write the checksums of every\n"
+                    "                     allocated block to PATH (one image only)\n"
+                    "  -j, --scrub-threads=N\n"
+                    "                     threads for the scrub (default one per CPU)\n"
+                    "  -r, --repair       rewrite the bitmap words and link counts that are\n"
+                    "                     wrong, if nothing else is\n"
+                    "  -D, --dry-run      print what --repair would rewrite, without writing\n"
+                    "  -R, --resume       continue from the --checkpoint file if it was taken\n"
+                    "                     on this image\n"
+                    "  -p, --perf         also count cycles, instructions, LLC and dTLB\n"
+                    "                     misses and page faults per phase (implies -s)\n"
+                    "  -s, --stats        print per-phase time and page faults\n");
+    exit(1);
+}
 
+int main(int argc, char *argv[]) {
+    static const struct option longopts[] = {
+        {"checks", required_argument, NULL, 'c'},
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"checkpoint-interval", required_argument, NULL, 'I'},
+        {"dry-run", no_argument, NULL, 'D'},
+        {"direct", no_argument, NULL, 'd'},
+        {"frag-report", no_argument, NULL, 'F'},
+        {"map", required_argument, NULL, 'm'},
+        {"merge", no_argument, NULL, 'X'},
+        {"metrics-file", required_argument, NULL, 'M'},
+        {"name-index", required_argument, NULL, 'N'},
+        {"owner-index", required_argument, NULL, 'O'},
+        {"paths", no_argument, NULL, 'n'},
+        {"perf", no_argument, NULL, 'p'},
+        {"progress", optional_argument, NULL, 'P'},
+        {"repair", no_argument, NULL, 'r'},
+        {"resume", no_argument, NULL, 'R'},
+        {"scrub", required_argument, NULL, 'k'},
+        {"scrub-threads", required_argument, NULL, 'j'},
+        {"scrub-write", required_argument, NULL, 'K'},
+        {"shard", required_argument, NULL, 'x'},
+        {"shard-out", required_argument, NULL, 'o'},
+        {"status-file", required_argument, NULL, 'S'},
+        {"stats", no_argument, NULL, 's'},
+        {"usage", no_argument, NULL, 'u'},
+        {NULL, 0, NULL, 0}
+    };
+    struct options opt = {0};
+    int merge = 0;
+    int checks = CHK_ALL;
+    int show_stats = 0;
+    const char *metrics_file = NULL;
+    double progress_secs = 0;
+    const char *status_file = NULL;
+    const char *checkpoint = NULL;
+    double checkpoint_secs = 60;
+    int c;
 
-    // Check for block in use but not marked in bitmap
-    for (uint blocknum = data_block_start; blocknum < sb->size; blocknum++) {
-        if (!block_is_marked(img_ptr, sb, blocknum) && block_used[blocknum]) {
-            fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-            free(inode_used); free(inode_referenced); free(inode_type);
-            free(inode_nlink); free(inode_linkcount); free(inode_parent);
-            free(block_used); free(block_type); close(fd);
-            exit(1);
+    while ((c = getopt_long(argc, argv, "c:C:dDFI:j:k:K:m:M:nN:o:O:pP::rRsS:ux:X", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'c':
+            if (parse_checks(optarg, &checks) < 0)
+                usage();
+            break;
+        case 'C':
+            checkpoint = optarg;
+            break;
+        case 'I':
+            checkpoint_secs = atof(optarg);
+            if (checkpoint_secs < CKPT_MIN_SECS)
+                usage();
+            break;
+        case 'd':
+            opt.img_flags |= IMG_DIRECT;
+            break;
+        case 'D':
+            opt.repair = opt.dry_run = 1;
+            break;
+        case 'F':
+            opt.frag = 1;
+            break;
+        case 'j':
+            opt.scrub_threads = atoi(optarg);
+            if (opt.scrub_threads <= 0)
+                usage();
+            break;
+        case 'k':
+            opt.scrub = optarg;
+            break;
+        case 'K':
+            opt.scrub_write = optarg;
+            break;
+        case 'm':
+            if (parse_map_modes(optarg, &opt.img_flags) < 0)
+                usage();
+            break;
+        case 'M':
+            metrics_file = optarg;
+            break;
+        case 'p':
+            show_stats = 1;
+            stats_enable_perf();
+            break;
+        case 'P':
+            progress_secs = optarg ? atof(optarg) : 5;
+            if (progress_secs <= 0)
+                usage();
+            break;
+        case 'n':
+            opt.paths = 1;
+            break;
+        case 'N':
+            opt.name_index = optarg;
+            break;
+        case 'o':
+            opt.shard_out = optarg;
+            break;
+        case 'O':
+            opt.owner_index = optarg;
+            break;
+        case 'r':
+            opt.repair = 1;
+            break;
+        case 'R':
+            opt.resume = 1;
+            break;
+        case 's':
+            show_stats = 1;
+            break;
+        case 'S':
+            status_file = optarg;
+            break;
+        case 'u':
+            opt.usage = 1;
+            break;
+        case 'x':
+            opt.shard = optarg;
+            break;
+        case 'X':
+            merge = 1;
+            break;
+        default:
+            usage();
         }
     }
+    if (optind >= argc)
+        usage();
+    // A checkpoint, a shard or an index describes one image; neither a
+    // shard's directory entries, the indexes nor the name table are part
+    // of a checkpoint or a shard
+    int nimages = argc - optind;
+    if ((checkpoint && nimages > 1) || (opt.resume && !checkpoint) ||
+        (opt.owner_index && (nimages > 1 || opt.shard || opt.resume || merge)) ||
+        (opt.name_index && (nimages > 1 || opt.shard || opt.resume || merge)) ||
+        (opt.paths && (opt.shard || opt.resume || merge)) ||
+        ((opt.frag || opt.usage) && (opt.shard || opt.resume || merge)) ||
+        ((opt.scrub || opt.scrub_write) && (nimages > 1 || opt.shard || merge)) ||
+        (opt.scrub && opt.scrub_write) ||
+        (opt.repair && (opt.shard || merge)) ||
+        (opt.shard && (nimages > 1 || !opt.shard_out || checkpoint)) ||
+        (merge && (nimages < 2 || opt.shard || checkpoint)))
+        usage();
+    opt.img_flags |= IMG_GZIP;
 
+    // One context serves every image on the command line; its arena is
+    // sized for the largest and only re-zeroed between images.
+    struct xcheck ctx;
+    ctx_init(&ctx, opt.img_flags, checks, opt.paths || opt.name_index || opt.usage);
+    ctx.batch = nimages > 1 && !merge;
 
-    // Free allocated memory and close file descriptor
-    free(inode_used);
-    free(inode_referenced);
-    free(inode_type);
-    free(inode_nlink);
-    free(inode_linkcount);
-    free(inode_parent);
-    free(block_used);
-    free(block_type);
-    close(fd);
+    if ((progress_secs > 0 || status_file) &&
+        progress_start(&ctx, progress_secs > 0 ? progress_secs : 5, status_file) < 0)
+        exit(1);
+    if (checkpoint && ckpt_start(checkpoint, checkpoint_secs) < 0) {
+        fprintf(stderr, "Error: cannot start checkpoint timer.\n");
+        exit(1);
+    }
 
-    // All checks passed
-    return 0;
+    int status = 0;
+    opt.checkpoint = checkpoint != NULL;
+    if (merge) {
+        status = merge_image(&ctx, argv[optind], argv + optind + 1, nimages - 1, opt.img_flags) < 0;
+    } else {
+        for (int i = optind; i < argc; i++) {
+            if (check_image(&ctx, argv[i], &opt) < 0)
+                status = 1;
+        }
+    }
+    progress_stop();
+
+    if (show_stats)
+        stats_report(stderr);
+    if (metrics_file && metrics_write(metrics_file, &ctx) < 0)
+        status = 1;
+    ctx_destroy(&ctx);
+    return status;
 }
 
 // Check if a block is marked in the bitmap
-int block_is_marked(void *img_ptr, struct superblock *sb, uint blocknum) {
-    uint bmapstart = xint(sb->bmapstart);
-    uint bmap_block = bmapstart + (blocknum / BPB);
+int block_is_marked(struct xcheck *ctx, uint blocknum) {
+    uint bmap_block = ctx->bmapstart + (blocknum / BPB);
     uint bmap_block_offset = blocknum % BPB;
 
-    uchar *bitmap_block = (uchar *)(img_ptr + bmap_block * BSIZE);
+    const uchar *bitmap_block = img_block(ctx->img, bmap_block);
 
     uint byte_index = bmap_block_offset / 8;
     uint bit_index = bmap_block_offset % 8;
@@ -389,48 +1414,101 @@ int block_is_marked(void *img_ptr, struct superblock *sb, uint blocknum) {
 
 
 // Get inode by inode number
-struct dinode *get_inode(void *img_ptr, struct superblock *sb, uint inum) {
-    uint block = sb->inodestart + inum / IPB;
+struct dinode *get_inode(struct xcheck *ctx, uint inum) {
+    uint block = ctx->inodestart + inum / IPB;
     uint offset = (inum % IPB) * sizeof(struct dinode);
-    return (struct dinode *)(img_ptr + block * BSIZE + offset);
+    return (struct dinode *)((const uchar *)img_block(ctx->img, block) + offset);
+}
+
+// Record name in the names seen in directory dir. Returns 1 if it was
+// there already, -1 if the table is full. The 14 name bytes, zeroed
+// after the terminator, are the key; probing is linear from the hash.
+static int dir_name_seen(struct xcheck *ctx, uint dir, const char *name) {
+    char key[16] = {0};
+    uint64_t lo, hi;
+
+    memcpy(key, name, strnlen(name, DIRSIZ));
+    memcpy(&lo, key, 8);
+    memcpy(&hi, key + 8, 8);
+    uint64_t h = (lo ^ (hi * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    uint i = (h ^ (h >> 32)) & (NAME_SLOTS - 1);
+    for (uint n = 0; n < NAME_SLOTS; n++, i = (i + 1) & (NAME_SLOTS - 1)) {
+        struct name_slot *s = &ctx->dir_names[i];
+        if (s->dir != dir + 1) {
+            s->dir = dir + 1;
+            memcpy(s->name, key, DIRSIZ);
+            return 0;
+        }
+        if (memcmp(s->name, key, DIRSIZ) == 0)
+            return 1;
+    }
+    fprintf(stderr, "Error: directory %u has more names than the name table holds.\n", dir);
+    return -1;
 }
 
 // Process a directory block
-void process_directory_block(void *img_ptr, uint addr, uint dir_inum, int *dot_found, int *dotdot_found, int *inode_referenced, int *inode_type, int *inode_used, int *inode_linkcount, int *inode_parent, uint num_inodes) {
-    struct dirent *de = (struct dirent *)(img_ptr + addr * BSIZE);
-    int num_entries = BSIZE / sizeof(struct dirent);
+int process_directory_block(struct xcheck *ctx, uint addr, uint dir_inum, uint fbn, int *dot_found, int *dotdot_found) {
+    // A directory block in a hole of a sparse image has no entries
+    if (img_is_hole(ctx->img, addr))
+        return 0;
 
-    for (int i = 0; i < num_entries; i++) {
-        if (de[i].inum == 0)
-            continue;
+    XTRACE2(dir__block, dir_inum, addr);
+    COUNT(ctx->blocks_scanned);
+    const struct dirent *de = img_block(ctx->img, addr);
+    struct dir_masks m;
 
-        ushort dir_inum_ref = xshort(de[i].inum);
+    // Classify the whole block first, then visit the entries in use in
+    // order, so errors come out as they would entry by entry
+    dir_block_scan(de, ctx->ninodes, &m);
+    for (uint32_t live = m.live; live; live &= live - 1) {
+        int i = __builtin_ctz(live);
+        uint32_t bit = (uint32_t)1 << i;
+        ushort dir_inum_ref = m.inum[i];
+        int is_name = 0;
 
-        if (strncmp(de[i].name, ".", DIRSIZ) == 0) {
+        if (ctx->checks & CHK_DIRS) {
+            int seen = dir_name_seen(ctx, dir_inum, de[i].name);
+            if (seen < 0)
+                return -1;
+            if (seen)
+                return xerr_entry(ctx, E_DUP_NAME, dir_inum, de[i].name, dir_inum_ref);
+        }
+
+        if (m.dot & bit) {
             *dot_found = 1;
-            if (dir_inum_ref != dir_inum) {
-                fprintf(stderr, "ERROR: directory not properly formatted.\n");
-                exit(1);
-            }
-        } else if (strncmp(de[i].name, "..", DIRSIZ) == 0) {
+            if (dir_inum_ref != dir_inum && (ctx->checks & CHK_DIRS))
+                return xerr_at(ctx, E_DIR_FORMAT, dir_inum, 0);
+        } else if (m.dotdot & bit) {
             *dotdot_found = 1;
-            inode_parent[dir_inum] = dir_inum_ref;
+            ctx->inode_parent[dir_inum] = dir_inum_ref;
+        } else {
+            is_name = 1;
+            if (ctx->inode_name && !(m.bad & bit) &&
+                ctx_add_name(ctx, dir_inum, dir_inum_ref, de[i].name, fbn * DPB + i) < 0)
+                return -1;
         }
 
-        if (dir_inum_ref >= num_inodes) {
-            fprintf(stderr, "ERROR: inode referred to in directory but marked free.\n");
-            exit(1);
+        // Other shards' inodes are not known here; --merge resolves
+        // the entry. "." and ".." only need their target checked.
+        if (ctx->sharded) {
+            if (NEED_EDGES(ctx->checks) && ctx_add_edge(ctx, is_name ? dir_inum : 0, dir_inum_ref) < 0)
+                return -1;
+            continue;
         }
 
-        if (!inode_used[dir_inum_ref]) {
-            fprintf(stderr, "ERROR: inode referred to in directory but marked free.\n");
-            exit(1);
+        if ((m.bad & bit) || !ctx->inode_type[dir_inum_ref]) {
+            if (ctx->checks & CHK_REACH)
+                return xerr_entry(ctx, E_INODE_FREE_REF, dir_inum, de[i].name, dir_inum_ref);
+            continue;
         }
 
-        inode_referenced[dir_inum_ref] = 1;
-
-        if (inode_type[dir_inum_ref] == T_FILE || inode_type[dir_inum_ref] == T_DIR) {
-            inode_linkcount[dir_inum_ref]++;
-        }
+        // "." and ".." are not references: a directory is named once,
+        // by its parent
+        if (ctx->inode_refs && is_name)
+            ctx->inode_refs[dir_inum_ref]++;
+        if ((ctx->checks & CHK_TREE) && is_name && ctx->inode_type[dir_inum_ref] == T_DIR &&
+            ctx_add_edge(ctx, dir_inum, dir_inum_ref) < 0)
+            return -1;
     }
+    return 0;
 }
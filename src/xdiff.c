@@ -0,0 +1,542 @@
+// xdiff.c - Report what changed between two images of one file system
+//
+// The images are compared block by block first: the metadata region and
+// every block either bitmap marks in use, a run of such blocks to each
+// memcmp(). Everything after that starts from the blocks that differ:
+// inodes whose table entry changed, the files that hold a changed block
+// and the entries of the directories that changed. Only those files are
+// compared further, and only they are named: a directory through its
+// ".." entry, anything else by the first directory found to hold it.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+
+// What changed about an inode
+#define CH_INODE   0x1        // Its table entry differs
+#define CH_DATA    0x2        // It holds a block that differs
+#define CH_NAME    0x4        // An entry naming it was added or removed
+#define CH_ENTRIES 0x8        // A directory whose entries differ
+
+// The name an inode was found under, looked up when a path needs it
+struct pname {
+    uint parent;              // 0 if no directory was found to name it
+    char name[DIRSIZ];
+    uchar looked;             // parent and name are settled
+};
+
+static struct image img[2];   // Old and new image
+static const struct superblock *sb;
+static uint64_t *changed;     // Bitset: block differs
+static uint64_t *unowned;     // Bitset: changed data block in use, owner not found yet
+static uint64_t nunowned;
+static uchar *flags;          // CH_* for each inode
+static struct pname *names[2];
+static int verbose;
+
+static void usage(void) {
+    fprintf(stderr, "Usage: xdiff [options] <old_image> <new_image>\n"
+                    "  -b, --blocks    also list the blocks that differ and what they hold\n"
+                    "  -v, --verbose   print the blocks compared, changed and the time taken\n"
+                    "Files are listed as A (added), D (deleted), M (modified) or R (renamed).\n"
+                    "A file whose path and contents both changed is listed as deleted and added.\n"
+                    "The exit status is 0 if the images are the same, 1 if they differ.\n");
+    exit(2);
+}
+
+static inline int bit_test(const uint64_t *map, uint i) {
+    return (map[i / 64] >> (i % 64)) & 1;
+}
+
+// What block bno holds
+static const char *block_kind(uint bno) {
+    if (bno == 0)
+        return "boot block";
+    if (bno == 1)
+        return "superblock";
+    if (bno >= sb->logstart && bno < sb->logstart + sb->nlog)
+        return "log";
+    if (bno >= sb->inodestart && bno < sb->bmapstart)
+        return "inode table";
+    if (bno >= sb->bmapstart && bno < sb->bmapstart + (sb->size + BPB - 1) / BPB)
+        return "bitmap";
+    return "data";
+}
+
+// Blocks [base, base + 64) worth comparing: the metadata region, and
+// data blocks either bitmap marks in use. A block free in both images
+// holds no file, whatever it contains.
+static uint64_t in_use(uint base, uint data_start) {
+    uint64_t word = 0;
+
+    for (int s = 0; s < 2; s++) {
+        const uchar *bp = (const uchar *)img_block(&img[s], sb->bmapstart + base / BPB) + (base % BPB) / 8;
+        for (int i = 0; i < 8; i++)
+            word |= (uint64_t)bp[i] << (8 * i);
+    }
+    if (base + 64 <= data_start)
+        word = ~(uint64_t)0;
+    else if (base < data_start)
+        word |= ((uint64_t)1 << (data_start - base)) - 1;
+    if (base + 64 > sb->size)
+        word &= ((uint64_t)1 << (sb->size - base)) - 1;
+    return word;
+}
+
+// Mark the blocks that differ, comparing each run of blocks in use with
+// one memcmp() and only the runs that differ block by block. Returns
+// how many differ.
+static uint64_t compare_blocks(uint64_t *compared) {
+    uint data_start = sb->bmapstart + (sb->size + BPB - 1) / BPB;
+    uint64_t n = 0;
+
+    *compared = 0;
+    for (uint base = 0; base < sb->size; base += 64) {
+        uint64_t word = in_use(base, data_start);
+        while (word) {
+            // The lowest run of set bits is [b, e)
+            uint64_t run = word & ~(word + (word & -word));
+            uint b = base + __builtin_ctzll(run), e = base + 64 - __builtin_clzll(run);
+            word &= ~run;
+            const uchar *p = img[0].map + (uint64_t)b * BSIZE;
+            const uchar *q = img[1].map + (uint64_t)b * BSIZE;
+            *compared += e - b;
+            if (memcmp(p, q, (size_t)(e - b) * BSIZE) == 0)
+                continue;
+            for (uint i = b; i < e; i++, p += BSIZE, q += BSIZE) {
+                if (memcmp(p, q, BSIZE) != 0) {
+                    changed[i / 64] |= (uint64_t)1 << (i % 64);
+                    n++;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+// Flag the inodes whose table entries differ
+static void compare_inodes(void) {
+    uint iend = sb->inodestart + (sb->ninodes + IPB - 1) / IPB;
+
+    for (uint b = sb->inodestart; b < iend; b++) {
+        if (!bit_test(changed, b))
+            continue;
+        for (uint inum = (b - sb->inodestart) * IPB; inum < sb->ninodes && inum / IPB == b - sb->inodestart; inum++)
+            if (memcmp(img_inode(&img[0], inum), img_inode(&img[1], inum), sizeof(struct dinode)) != 0)
+                flags[inum] |= CH_INODE;
+    }
+}
+
+static inline void note_block(uint inum, uint addr) {
+    if (addr > 0 && addr < sb->size && bit_test(changed, addr)) {
+        flags[inum] |= CH_DATA;
+        if (bit_test(unowned, addr)) {
+            unowned[addr / 64] &= ~((uint64_t)1 << (addr % 64));
+            nunowned--;
+        }
+    }
+}
+
+// Flag the inodes of the new image that hold a changed data block,
+// directly, as their indirect block or through it. The inode table
+// settles the direct and indirect block addresses; indirect blocks are
+// read only while some changed block the new bitmap marks in use has
+// no owner yet, and only until each has one.
+static void find_owners(uint data_start) {
+    const struct dinode *dip = NULL;
+
+    unowned = calloc(((size_t)sb->size + 63) / 64, sizeof(uint64_t));
+    if (unowned == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        exit(2);
+    }
+    for (uint w = data_start / 64; w < (sb->size + 63) / 64; w++) {
+        for (uint64_t word = changed[w]; word; word &= word - 1) {
+            uint b = w * 64 + __builtin_ctzll(word);
+            const uchar *bp = img_block(&img[1], sb->bmapstart + b / BPB);
+            if (b >= data_start && (bp[(b % BPB) / 8] >> (b % 8) & 1)) {
+                unowned[w] |= (uint64_t)1 << (b % 64);
+                nunowned++;
+            }
+        }
+    }
+    // Inodes with an indirect block, and its address
+    uint (*ind)[2] = NULL;
+    uint nind = 0, cap = 0;
+    for (uint inum = 1; inum < sb->ninodes; inum++) {
+        if (inum == 1 || inum % IPB == 0)
+            dip = img_inode(&img[1], inum);
+        else
+            dip++;
+        if (dip->type == 0)
+            continue;
+        for (int i = 0; i < NDIRECT; i++)
+            note_block(inum, dip->addrs[i]);
+        note_block(inum, dip->addrs[NDIRECT]);
+        if (dip->addrs[NDIRECT] == 0 || dip->addrs[NDIRECT] >= sb->size)
+            continue;
+        if (nind == cap) {
+            cap = cap ? 2 * cap : 1024;
+            ind = realloc(ind, cap * sizeof(*ind));
+            if (ind == NULL) {
+                fprintf(stderr, "Error: out of memory.\n");
+                exit(2);
+            }
+        }
+        ind[nind][0] = inum;
+        ind[nind++][1] = dip->addrs[NDIRECT];
+    }
+    for (uint k = 0; k < nind && nunowned > 0; k++) {
+        const uint *a = img_block(&img[1], ind[k][1]);
+        for (uint i = 0; i < NINDIRECT; i++)
+            note_block(ind[k][0], a[i]);
+    }
+    free(ind);
+    free(unowned);
+}
+
+// The entries of a directory
+struct entries {
+    struct dirent *e;
+    uint n;
+    uint cap;
+};
+
+static uint collect_entry(const struct dirent *de, void *arg) {
+    struct entries *es = arg;
+
+    if (es->n == es->cap) {
+        es->cap = es->cap ? 2 * es->cap : 64;
+        es->e = realloc(es->e, es->cap * sizeof(struct dirent));
+        if (es->e == NULL) {
+            fprintf(stderr, "Error: out of memory.\n");
+            exit(2);
+        }
+    }
+    es->e[es->n++] = *de;
+    return 0;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    const struct dirent *x = a, *y = b;
+    int c = strncmp(x->name, y->name, DIRSIZ);
+    return c ? c : (x->inum > y->inum) - (x->inum < y->inum);
+}
+
+static void name_changed(const struct dirent *de) {
+    if (strncmp(de->name, ".", DIRSIZ) != 0 && strncmp(de->name, "..", DIRSIZ) != 0 && de->inum < sb->ninodes)
+        flags[de->inum] |= CH_NAME;
+}
+
+// Compare the entries of directory inum in the two images, flagging the
+// inodes named by entries only one of them has. A side where inum is
+// not a directory has no entries.
+static void compare_entries(uint inum) {
+    struct entries es[2] = {{0}};
+
+    for (int s = 0; s < 2; s++) {
+        const struct dinode *dip = img_inode(&img[s], inum);
+        if (dip->type == T_DIR)
+            img_each_entry(&img[s], dip, collect_entry, &es[s]);
+        qsort(es[s].e, es[s].n, sizeof(struct dirent), entry_cmp);
+    }
+    uint i = 0, j = 0;
+    while (i < es[0].n || j < es[1].n) {
+        int c = i == es[0].n ? 1 : j == es[1].n ? -1 : entry_cmp(&es[0].e[i], &es[1].e[j]);
+        if (c == 0) {
+            i++;
+            j++;
+            continue;
+        }
+        flags[inum] |= CH_ENTRIES;
+        name_changed(c < 0 ? &es[0].e[i++] : &es[1].e[j++]);
+    }
+    free(es[0].e);
+    free(es[1].e);
+}
+
+static int is_dot(const struct dirent *de) {
+    return strncmp(de->name, ".", DIRSIZ) == 0 || strncmp(de->name, "..", DIRSIZ) == 0;
+}
+
+// A search of the directories for entries naming the inodes wanted
+struct search {
+    struct image *img;
+    struct pname *pn;
+    uint dir;
+    uint left;                // Inodes still without a name
+    uint child;               // Directory whose name is wanted (name_dir)
+};
+
+static uint name_file(const struct dirent *de, void *arg) {
+    struct search *f = arg;
+
+    if (de->inum >= sb->ninodes || !flags[de->inum] || f->pn[de->inum].parent != 0 || is_dot(de))
+        return 0;
+    const struct dinode *dip = img_inode(f->img, de->inum);
+    if (dip->type == 0 || dip->type == T_DIR)
+        return 0;
+    f->pn[de->inum].parent = f->dir;
+    memcpy(f->pn[de->inum].name, de->name, DIRSIZ);
+    return --f->left == 0;
+}
+
+// Name the flagged files of image s: one pass over its directories that
+// stops once every one of them is named
+static struct pname *name_files(int s) {
+    struct search f = {.img = &img[s]};
+
+    f.pn = calloc(sb->ninodes, sizeof(struct pname));
+    if (f.pn == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        exit(2);
+    }
+    for (uint inum = 1; inum < sb->ninodes; inum++) {
+        if (!flags[inum])
+            continue;
+        uint type = img_inode(f.img, inum)->type;
+        if (type != 0 && type != T_DIR) {
+            f.pn[inum].looked = 1;
+            f.left++;
+        }
+    }
+    for (f.dir = 1; f.dir < sb->ninodes && f.left > 0; f.dir++) {
+        const struct dinode *dip = img_inode(f.img, f.dir);
+        if (dip->type == T_DIR)
+            img_each_entry(f.img, dip, name_file, &f);
+    }
+    return f.pn;
+}
+
+static uint match_child(const struct dirent *de, void *arg) {
+    struct search *f = arg;
+
+    if (de->inum != f->child || is_dot(de))
+        return 0;
+    f->pn[f->child].parent = f->dir;
+    memcpy(f->pn[f->child].name, de->name, DIRSIZ);
+    return 1;
+}
+
+static uint search_dir(struct search *f) {
+    if (f->dir == 0 || f->dir == f->child || f->dir >= sb->ninodes)
+        return 0;
+    const struct dinode *dip = img_inode(f->img, f->dir);
+    return dip->type == T_DIR ? img_each_entry(f->img, dip, match_child, f) : 0;
+}
+
+// Name directory inum of image s: its ".." gives the parent, and the
+// parent's entry for it the name. A directory its ".." does not name
+// is searched for in every directory.
+static void name_dir(int s, uint inum) {
+    struct search f = {.img = &img[s], .pn = names[s], .child = inum};
+
+    names[s][inum].looked = 1;
+    f.dir = img_lookup(f.img, inum, "..");
+    if (search_dir(&f))
+        return;
+    for (f.dir = 1; f.dir < sb->ninodes && !search_dir(&f); f.dir++)
+        ;
+}
+
+// Path of inode inum in image s, built backwards from the end of buf
+static const char *path_of(int s, uint inum, char *buf, size_t len) {
+    const struct pname *pn = names[s];
+    size_t pos = len - 1;
+
+    if (inum == ROOTINO)
+        return "/";
+    buf[pos] = '\0';
+    for (uint i = inum; i != ROOTINO; i = pn[i].parent) {
+        if (!pn[i].looked)
+            name_dir(s, i);
+        size_t l = strnlen(pn[i].name, DIRSIZ);
+        if (pn[i].parent == 0 || pos < l + 1) {
+            snprintf(buf, len, "<inode %u>", inum);
+            return buf;
+        }
+        pos -= l;
+        memcpy(buf + pos, pn[i].name, l);
+        buf[--pos] = '/';
+    }
+    return buf + pos;
+}
+
+// Do the first min(size) bytes of the two versions of a file differ?
+static int content_differs(const struct dinode *a, const struct dinode *b) {
+    uint size = a->size < b->size ? a->size : b->size;
+
+    for (uint n = 0; (uint64_t)n * BSIZE < size && n < MAXFILE; n++) {
+        uint x = img_bmap(&img[0], a, n), y = img_bmap(&img[1], b, n);
+        uint len = size - n * BSIZE < BSIZE ? size - n * BSIZE : BSIZE;
+        static const uchar zero[BSIZE];
+        const uchar *p = x ? img_block(&img[0], x) : zero;
+        const uchar *q = y ? img_block(&img[1], y) : zero;
+        if (memcmp(p, q, len) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Print one line for inode inum. Returns 1 if it changed. An inode
+// whose path and contents both changed was most likely freed and
+// reused, so it is listed as deleted and added rather than renamed.
+static int report(uint inum) {
+    const struct dinode *a = img_inode(&img[0], inum), *b = img_inode(&img[1], inum);
+    char obuf[4096], nbuf[4096], what[256];
+    const char *opath = a->type ? path_of(0, inum, obuf, sizeof(obuf)) : NULL;
+    const char *npath = b->type ? path_of(1, inum, nbuf, sizeof(nbuf)) : NULL;
+    int n = 0;
+
+    if (a->type != b->type) {
+        if (opath)
+            printf("D %s\n", opath);
+        if (npath)
+            printf("A %s\n", npath);
+        return opath || npath;
+    }
+    if (a->type == 0)
+        return 0;
+
+    what[0] = '\0';
+    if (b->type == T_DIR && (flags[inum] & CH_ENTRIES))
+        n += snprintf(what + n, sizeof(what) - n, ", entries");
+    else if (b->type != T_DIR && ((flags[inum] & CH_DATA) || memcmp(a->addrs, b->addrs, sizeof(a->addrs)) != 0) &&
+             content_differs(a, b))
+        n += snprintf(what + n, sizeof(what) - n, ", data");
+    if (a->size != b->size)
+        n += snprintf(what + n, sizeof(what) - n, ", size %u -> %u", a->size, b->size);
+    if (n > 0 && strcmp(opath, npath) != 0) {
+        printf("D %s\nA %s\n", opath, npath);
+        return 1;
+    }
+    if (a->nlink != b->nlink)
+        n += snprintf(what + n, sizeof(what) - n, ", links %d -> %d", a->nlink, b->nlink);
+    if (a->major != b->major || a->minor != b->minor)
+        n += snprintf(what + n, sizeof(what) - n, ", device %d,%d -> %d,%d", a->major, a->minor, b->major, b->minor);
+
+    if (strcmp(opath, npath) != 0)
+        printf("R %s -> %s%s%s%s\n", opath, npath, n ? " (" : "", n ? what + 2 : "", n ? ")" : "");
+    else if (n)
+        printf("M %s (%s)\n", npath, what + 2);
+    return strcmp(opath, npath) != 0 || n > 0;
+}
+
+// List the runs of changed blocks, split where their kind changes
+static void list_blocks(void) {
+    for (uint b = 0; b < sb->size; b++) {
+        if (!bit_test(changed, b))
+            continue;
+        const char *kind = block_kind(b);
+        uint e = b + 1;
+        while (e < sb->size && bit_test(changed, e) && block_kind(e) == kind)
+            e++;
+        if (e == b + 1)
+            printf("block %u (%s)\n", b, kind);
+        else
+            printf("blocks %u-%u (%s)\n", b, e - 1, kind);
+        b = e - 1;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longopts[] = {
+        {"blocks", no_argument, NULL, 'b'},
+        {"verbose", no_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}
+    };
+    int show_blocks = 0;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "bv", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'b':
+            show_blocks = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 2)
+        usage();
+
+    const struct superblock *sbs[2];
+    for (int s = 0; s < 2; s++) {
+        if (img_open(&img[s], argv[optind + s], 0) < 0 || (sbs[s] = img_sb(&img[s])) == NULL)
+            exit(2);
+    }
+    sb = sbs[1];
+    if (memcmp(sbs[0], sbs[1], sizeof(*sb)) != 0) {
+        fprintf(stderr, "Error: the images have different superblocks.\n");
+        exit(2);
+    }
+    changed = calloc(((size_t)sb->size + 63) / 64, sizeof(uint64_t));
+    flags = calloc(sb->ninodes, 1);
+    if (changed == NULL || flags == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        exit(2);
+    }
+
+    // One pass over both images, then scattered reads
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int s = 0; s < 2; s++)
+        madvise(img[s].map, img[s].size, MADV_SEQUENTIAL);
+    uint64_t ncompared;
+    uint64_t nchanged = compare_blocks(&ncompared);
+    for (int s = 0; s < 2; s++)
+        madvise(img[s].map, img[s].size, MADV_RANDOM);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    uint data_start = sb->bmapstart + (sb->size + BPB - 1) / BPB;
+    uint64_t ndata = 0;
+    for (uint b = data_start; b < sb->size; b++)
+        ndata += bit_test(changed, b);
+    int differ = nchanged > 0;
+    if (nchanged > ndata)
+        compare_inodes();
+    if (ndata > 0)
+        find_owners(data_start);
+    for (uint inum = 1; inum < sb->ninodes; inum++) {
+        if (flags[inum] && (img_inode(&img[0], inum)->type == T_DIR || img_inode(&img[1], inum)->type == T_DIR))
+            compare_entries(inum);
+    }
+
+    uint nfiles = 0;
+    for (uint inum = 1; inum < sb->ninodes; inum++) {
+        if (!flags[inum])
+            continue;
+        if (names[0] == NULL) {
+            names[0] = name_files(0);
+            names[1] = name_files(1);
+        }
+        nfiles += report(inum);
+    }
+    if (show_blocks)
+        list_blocks();
+    if (verbose) {
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%llu blocks compared in %.2f s (%.1f MB/s), %llu differ (%llu data); %u files changed\n",
+               (unsigned long long)ncompared, secs, secs > 0 ? 2.0 * ncompared * BSIZE / 1e6 / secs : 0.0,
+               (unsigned long long)nchanged, (unsigned long long)ndata, nfiles);
+    }
+
+    free(changed);
+    free(flags);
+    free(names[0]);
+    free(names[1]);
+    img_close(&img[0]);
+    img_close(&img[1]);
+    return differ;
+}
@@ -0,0 +1,325 @@
+// xextract.c - Copy files, subtrees or the whole tree out of an xv6 image
+//
+// A file is copied as runs of blocks that are contiguous in the image.
+// copy_file_range() moves each run from the image to the output inside
+// the kernel; where the file systems do not support that, the runs are
+// written straight from the image mapping with pwritev(), as many at a
+// time as are contiguous in the output. Unmapped blocks and addresses
+// outside the file system become holes.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "names.h"
+
+#define IOV_BATCH 64          // Runs per pwritev() call
+
+static struct image img;
+static uint64_t *dir_seen;    // Bitset: directory already extracted
+static int use_copy_range = 1;
+static int verbose;
+static int status;
+static uint64_t files_copied;
+static uint64_t bytes_copied;
+
+static void usage(void) {
+    fprintf(stderr, "Usage: xextract [options] <file_system_image> [PATH]...\n"
+                    "  -C, --directory=DIR  extract into DIR (default .)\n"
+                    "  -i, --index=PATH     resolve paths through the name index written by\n"
+                    "                       xcheck --name-index\n"
+                    "  -v, --verbose        print each file extracted and the totals\n"
+                    "  -w, --write          write from the image mapping instead of using\n"
+                    "                       copy_file_range()\n"
+                    "With no PATH, the whole tree is extracted.\n");
+    exit(1);
+}
+
+// Runs waiting to be written, contiguous in the output from off
+struct batch {
+    int fd;
+    off_t off;
+    size_t len;
+    int n;
+    struct iovec iov[IOV_BATCH];
+};
+
+static int flush(struct batch *b) {
+    struct iovec *iov = b->iov;
+    int n = b->n;
+
+    while (b->len > 0) {
+        ssize_t w = pwritev(b->fd, iov, n, b->off);
+        if (w <= 0)
+            return -1;
+        b->off += w;
+        b->len -= w;
+        // Drop what was written and retry the rest
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (uchar *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    b->n = 0;
+    return 0;
+}
+
+// Copy len bytes from block addr to offset off of the output
+static int copy_run(struct batch *b, uint addr, off_t off, size_t len) {
+    loff_t in = (loff_t)addr * BSIZE, out = off;
+
+    while (use_copy_range && len > 0) {
+        ssize_t w = copy_file_range(img.fd, &in, b->fd, &out, len, 0);
+        if (w > 0) {
+            len -= w;
+            continue;
+        }
+        if (w == 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP))
+            return -1;
+        use_copy_range = 0;
+    }
+    if (len == 0)
+        return 0;
+
+    off = out;
+    if (b->n == IOV_BATCH || (b->n > 0 && b->off + (off_t)b->len != off))
+        if (flush(b) < 0)
+            return -1;
+    if (b->n == 0) {
+        b->off = off;
+        b->len = 0;
+    }
+    b->iov[b->n].iov_base = img.map + in;
+    b->iov[b->n].iov_len = len;
+    b->n++;
+    b->len += len;
+    return 0;
+}
+
+static void copy_file(const struct dinode *dip, const char *path) {
+    uint64_t size = dip->size;
+    struct batch b = {0};
+
+    if (size > (uint64_t)MAXFILE * BSIZE) {
+        fprintf(stderr, "xextract: %s: size %u is past the largest file, truncated\n", path, dip->size);
+        size = (uint64_t)MAXFILE * BSIZE;
+        status = 1;
+    }
+    b.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (b.fd < 0) {
+        perror(path);
+        status = 1;
+        return;
+    }
+
+    uint nblocks = (size + BSIZE - 1) / BSIZE;
+    int err = 0;
+    for (uint n = 0; n < nblocks && !err; ) {
+        uint addr = img_bmap(&img, dip, n);
+        if (addr == 0) {
+            n++;
+            continue;
+        }
+        uint m = n + 1;
+        while (m < nblocks && img_bmap(&img, dip, m) == addr + (m - n))
+            m++;
+        uint64_t end = (uint64_t)m * BSIZE < size ? (uint64_t)m * BSIZE : size;
+        err = copy_run(&b, addr, (off_t)n * BSIZE, end - (uint64_t)n * BSIZE) < 0;
+        n = m;
+    }
+    err = err || (b.n > 0 && flush(&b) < 0);
+    // Trailing holes
+    err = err || ftruncate(b.fd, size) < 0;
+    err |= close(b.fd) < 0;
+    if (err) {
+        perror(path);
+        status = 1;
+        return;
+    }
+    files_copied++;
+    bytes_copied += size;
+    if (verbose)
+        printf("%s\n", path);
+}
+
+static void extract(uint inum, const char *path);
+
+static uint extract_entry(const struct dirent *de, void *arg) {
+    const char *dir = arg;
+    int len = strnlen(de->name, DIRSIZ);
+
+    if (strncmp(de->name, ".", DIRSIZ) == 0 || strncmp(de->name, "..", DIRSIZ) == 0)
+        return 0;
+    if (len == 0 || memchr(de->name, '/', len)) {
+        fprintf(stderr, "xextract: %s: skipping entry with a bad name (inode %u)\n", dir, de->inum);
+        status = 1;
+        return 0;
+    }
+
+    size_t n = strlen(dir) + len + 2;
+    char *path = malloc(n);
+    if (path == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        exit(1);
+    }
+    snprintf(path, n, "%s/%.*s", dir, len, de->name);
+    extract(de->inum, path);
+    free(path);
+    return 0;
+}
+
+// Extract inode inum to path on the host
+static void extract(uint inum, const char *path) {
+    const struct dinode *dip = img_inode(&img, inum);
+
+    if (dip == NULL || dip->type == 0) {
+        fprintf(stderr, "xextract: %s: names free inode %u, skipped\n", path, inum);
+        status = 1;
+        return;
+    }
+    switch (dip->type) {
+    case T_FILE:
+        copy_file(dip, path);
+        return;
+    case T_DIR:
+        // A directory named twice, or a loop, is only extracted once
+        if ((dir_seen[inum / 64] >> (inum % 64)) & 1) {
+            fprintf(stderr, "xextract: %s: directory %u already extracted, skipped\n", path, inum);
+            status = 1;
+            return;
+        }
+        dir_seen[inum / 64] |= (uint64_t)1 << (inum % 64);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            perror(path);
+            status = 1;
+            return;
+        }
+        img_each_entry(&img, dip, extract_entry, (void *)path);
+        return;
+    case T_DEV:
+        fprintf(stderr, "xextract: %s: device %d,%d, skipped\n", path, dip->major, dip->minor);
+        return;
+    default:
+        fprintf(stderr, "xextract: %s: inode %u has bad type %d, skipped\n", path, inum, dip->type);
+        status = 1;
+    }
+}
+
+// Last component of path, or "" if it names the root or walks up
+static const char *base_name(const char *path) {
+    const char *end = path + strlen(path);
+
+    while (end > path && end[-1] == '/')
+        end--;
+    const char *start = end;
+    while (start > path && start[-1] != '/')
+        start--;
+    if (end == start || (end - start == 1 && *start == '.') || (end - start == 2 && strncmp(start, "..", 2) == 0))
+        return "";
+    return start;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longopts[] = {
+        {"directory", required_argument, NULL, 'C'},
+        {"index", required_argument, NULL, 'i'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"write", no_argument, NULL, 'w'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *outdir = ".";
+    const char *index_path = NULL;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "C:i:vw", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'C':
+            outdir = optarg;
+            break;
+        case 'i':
+            index_path = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'w':
+            use_copy_range = 0;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+
+    if (img_open(&img, argv[optind], 0) < 0)
+        exit(1);
+    const struct superblock *sb = img_sb(&img);
+    if (sb == NULL)
+        exit(1);
+    struct name_index nx, *index_map = NULL;
+    if (index_path) {
+        if (names_load(&nx, index_path) < 0)
+            exit(1);
+        if (memcmp(&nx.hdr->sb, sb, sizeof(*sb)) != 0 || nx.hdr->image_size != img.size) {
+            fprintf(stderr, "Error: %s was not written for this image.\n", index_path);
+            exit(1);
+        }
+        index_map = &nx;
+    }
+    dir_seen = calloc(((size_t)sb->ninodes + 63) / 64, sizeof(uint64_t));
+    if (dir_seen == NULL) {
+        fprintf(stderr, "Error: out of memory.\n");
+        exit(1);
+    }
+    // Runs are read once, front to back
+    posix_fadvise(img.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    char *root[] = {"/"};
+    char **paths = optind + 1 < argc ? argv + optind + 1 : root;
+    int npaths = optind + 1 < argc ? argc - optind - 1 : 1;
+
+    for (int i = 0; i < npaths; i++) {
+        uint inum;
+        int err = names_resolve(&img, index_map, paths[i], &inum);
+        if (err) {
+            fprintf(stderr, "xextract: %s: %s\n", paths[i], strerror(err));
+            status = 1;
+            continue;
+        }
+        // The root, or a path ending in "." or "..", goes into DIR itself
+        const char *base = base_name(paths[i]);
+        size_t n = strlen(outdir) + strlen(base) + 2;
+        char *dest = malloc(n);
+        if (dest == NULL) {
+            fprintf(stderr, "Error: out of memory.\n");
+            exit(1);
+        }
+        snprintf(dest, n, "%s%s%.*s", outdir, *base ? "/" : "", (int)strcspn(base, "/"), base);
+        extract(inum, dest);
+        free(dest);
+    }
+
+    if (verbose)
+        printf("%llu files, %llu bytes\n", (unsigned long long)files_copied, (unsigned long long)bytes_copied);
+    free(dir_seen);
+    if (index_map)
+        names_unload(index_map);
+    img_close(&img);
+    return status;
+}
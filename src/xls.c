@@ -0,0 +1,176 @@
+// xls.c - List directories and look up paths in an xv6 image
+//
+// Paths are resolved from the root one component at a time. Without an
+// index each component scans the directory's blocks; with a name index
+// from xcheck --name-index it is one hash lookup, however large the
+// directory.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+#include "names.h"
+
+static struct image img;
+static struct name_index *index_map;  // NULL without -i
+
+static void usage(void) {
+    fprintf(stderr, "Usage: xls [options] <file_system_image> [PATH]...\n"
+                    "  -d, --directory    list directories themselves, not their contents\n"
+                    "  -i, --index=PATH   resolve paths through the name index written by\n"
+                    "                     xcheck --name-index\n"
+                    "  -l, --long         also print inode, type, link count and size\n"
+                    "  -s, --stat         print each path's inode and the blocks it holds\n");
+    exit(1);
+}
+
+static const char *type_name(int type) {
+    switch (type) {
+    case 0:
+        return "free";
+    case T_DIR:
+        return "dir";
+    case T_FILE:
+        return "file";
+    case T_DEV:
+        return "dev";
+    default:
+        return "bad";
+    }
+}
+
+static void print_entry(uint inum, const char *name, int len, int long_form) {
+    const struct dinode *dip = img_inode(&img, inum);
+
+    if (long_form && dip)
+        printf("%8u %-4s %3d %10u ", inum, type_name(dip->type), dip->nlink, dip->size);
+    else if (long_form)
+        printf("%8u %-4s %3s %10s ", inum, "?", "?", "?");
+    printf("%.*s\n", len, name);
+}
+
+static int long_listing;
+
+static uint list_one(const struct dirent *de, void *arg) {
+    (void)arg;
+    print_entry(de->inum, de->name, strnlen(de->name, DIRSIZ), long_listing);
+    return 0;
+}
+
+// Print the inode at path and the runs of blocks it holds
+static void print_stat(const char *path, uint inum) {
+    const struct dinode *dip = img_inode(&img, inum);
+    uint nblocks = (dip->size + BSIZE - 1) / BSIZE;
+
+    printf("path: %s\ninode: %u\ntype: %s", path, inum, type_name(dip->type));
+    if (dip->type == T_DEV)
+        printf(" %d,%d", dip->major, dip->minor);
+    else if (dip->type != 0 && dip->type != T_DIR && dip->type != T_FILE)
+        printf(" (%d)", dip->type);
+    printf("\nlinks: %d\nsize: %u\nblocks:", dip->nlink, dip->size);
+
+    uint first = 0, last = 0;
+    for (uint n = 0; n <= nblocks && n <= MAXFILE; n++) {
+        uint addr = n < nblocks ? img_bmap(&img, dip, n) : 0;
+        if (addr && first && addr == last + 1) {
+            last = addr;
+            continue;
+        }
+        if (first && first == last)
+            printf(" %u", first);
+        else if (first)
+            printf(" %u-%u", first, last);
+        first = last = addr;
+    }
+    if (dip->addrs[NDIRECT])
+        printf(" (indirect %u)", dip->addrs[NDIRECT]);
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longopts[] = {
+        {"directory", no_argument, NULL, 'd'},
+        {"index", required_argument, NULL, 'i'},
+        {"long", no_argument, NULL, 'l'},
+        {"stat", no_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *index_path = NULL;
+    int dir_itself = 0;
+    int show_stat = 0;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "di:ls", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'd':
+            dir_itself = 1;
+            break;
+        case 'i':
+            index_path = optarg;
+            break;
+        case 'l':
+            long_listing = 1;
+            break;
+        case 's':
+            show_stat = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+
+    if (img_open(&img, argv[optind], 0) < 0)
+        exit(1);
+    const struct superblock *sb = img_sb(&img);
+    if (sb == NULL)
+        exit(1);
+    struct name_index nx;
+    if (index_path) {
+        if (names_load(&nx, index_path) < 0)
+            exit(1);
+        if (memcmp(&nx.hdr->sb, sb, sizeof(*sb)) != 0 || nx.hdr->image_size != img.size) {
+            fprintf(stderr, "Error: %s was not written for this image.\n", index_path);
+            exit(1);
+        }
+        index_map = &nx;
+    }
+
+    char *root[] = {"/"};
+    char **paths = optind + 1 < argc ? argv + optind + 1 : root;
+    int npaths = optind + 1 < argc ? argc - optind - 1 : 1;
+    int status = 0;
+
+    for (int i = 0; i < npaths; i++) {
+        uint inum;
+        int err = names_resolve(&img, index_map, paths[i], &inum);
+        if (err) {
+            fprintf(stderr, "xls: %s: %s\n", paths[i], strerror(err));
+            status = 1;
+            continue;
+        }
+        const struct dinode *dip = img_inode(&img, inum);
+        if (show_stat) {
+            if (i > 0)
+                printf("\n");
+            print_stat(paths[i], inum);
+        } else if (dip->type != T_DIR || dir_itself) {
+            print_entry(inum, paths[i], strlen(paths[i]), long_listing);
+        } else {
+            if (npaths > 1)
+                printf("%s%s:\n", i > 0 ? "\n" : "", paths[i]);
+            img_each_entry(&img, dip, list_one, NULL);
+        }
+    }
+
+    if (index_map)
+        names_unload(index_map);
+    img_close(&img);
+    return status;
+}
@@ -0,0 +1,166 @@
+// xowner.c - Look up which inode owns file system blocks
+//
+// Answers from the index written by xcheck --owner-index, one array
+// access per block, without touching the image.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "types.h"
+#include "fs.h"
+#include "owner.h"
+
+static void usage(void) {
+    fprintf(stderr, "Usage: xowner [options] <owner_index> [BLOCK | FIRST-LAST]...\n"
+                    "  -f, --file=PATH    also read blocks and ranges from PATH, one per\n"
+                    "                     line ('-' for stdin, '#' starts a comment)\n"
+                    "  -u, --used-only    print only blocks that some inode claims\n");
+    exit(1);
+}
+
+// What block bno holds, for blocks outside the data area
+static const char *meta_kind(const struct superblock *sb, uint bno) {
+    if (bno == 0)
+        return "boot block";
+    if (bno == 1)
+        return "superblock";
+    if (bno >= sb->logstart && bno < sb->logstart + sb->nlog)
+        return "log";
+    if (bno >= sb->inodestart && bno < sb->bmapstart)
+        return "inode table";
+    if (bno >= sb->bmapstart && bno < sb->bmapstart + (sb->size + BPB - 1) / BPB)
+        return "bitmap";
+    return NULL;
+}
+
+static void show(struct owner_index *ox, uint bno, int used_only) {
+    const struct superblock *sb = &ox->hdr->sb;
+
+    if (bno >= ox->hdr->nblocks) {
+        printf("%u: beyond the file system (%u blocks)\n", bno, sb->size);
+        return;
+    }
+    const char *kind = meta_kind(sb, bno);
+    if (kind) {
+        if (used_only)
+            return;
+        if (bno >= sb->inodestart && bno < sb->bmapstart) {
+            uint first = (bno - sb->inodestart) * IPB;
+            printf("%u: inode table, inodes %u-%u\n", bno, first, first + (uint)IPB - 1);
+        } else {
+            printf("%u: %s\n", bno, kind);
+        }
+        return;
+    }
+
+    const struct owner *o = &ox->rec[bno];
+    if (o->inum == 0) {
+        if (!used_only)
+            printf("%u: not claimed by any inode\n", bno);
+        return;
+    }
+    printf("%u: inode %u, ", bno, o->inum);
+    if (o->slot < OWN_INDIRECT)
+        printf("direct address %u (file block %u)", o->slot, o->slot);
+    else if (o->slot == OWN_INDIRECT)
+        printf("indirect block");
+    else
+        printf("indirect entry %u (file block %u)", o->slot - OWN_ENTRY(0), NDIRECT + o->slot - OWN_ENTRY(0));
+    printf("%s\n", (o->flags & OWN_DUP) ? ", also claimed elsewhere" : "");
+}
+
+// Look up one argument: a block number or an inclusive range
+static int query(struct owner_index *ox, const char *arg, int used_only) {
+    unsigned long first, last;
+    char *end;
+
+    first = strtoul(arg, &end, 0);
+    if (end == arg)
+        return -1;
+    last = first;
+    if (*end == '-') {
+        const char *p = end + 1;
+        last = strtoul(p, &end, 0);
+        if (end == p || last < first)
+            return -1;
+    }
+    if (*end != '\0' || last > UINT32_MAX)
+        return -1;
+    for (unsigned long b = first; b <= last; b++)
+        show(ox, b, used_only);
+    return 0;
+}
+
+static int query_file(struct owner_index *ox, const char *path, int used_only) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char line[256];
+    int status = 0;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line + strspn(line, " \t");
+        p[strcspn(p, "#\r\n")] = '\0';
+        for (char *q = p + strlen(p); q > p && (q[-1] == ' ' || q[-1] == '\t'); )
+            *--q = '\0';
+        if (*p == '\0')
+            continue;
+        if (query(ox, p, used_only) < 0) {
+            fprintf(stderr, "xowner: bad block or range: %s\n", p);
+            status = -1;
+        }
+    }
+    if (f != stdin)
+        fclose(f);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longopts[] = {
+        {"file", required_argument, NULL, 'f'},
+        {"used-only", no_argument, NULL, 'u'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *list = NULL;
+    int used_only = 0;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "f:u", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'f':
+            list = optarg;
+            break;
+        case 'u':
+            used_only = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc || (optind + 1 == argc && !list))
+        usage();
+
+    struct owner_index ox;
+    if (owner_load(&ox, argv[optind]) < 0)
+        exit(1);
+    if (!ox.hdr->complete)
+        fprintf(stderr, "warning: the check stopped during the inode scan; "
+                        "blocks of later inodes are not in the index.\n");
+
+    int status = 0;
+    for (int i = optind + 1; i < argc; i++) {
+        if (query(&ox, argv[i], used_only) < 0) {
+            fprintf(stderr, "xowner: bad block or range: %s\n", argv[i]);
+            status = 1;
+        }
+    }
+    if (list && query_file(&ox, list, used_only) < 0)
+        status = 1;
+    owner_unload(&ox);
+    return status;
+}
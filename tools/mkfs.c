@@ -6,11 +6,17 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/stat.h>
 #include "types.h"
 #include "fs.h"
 
+// The geometry can be set at build time (-DFSSIZE=... -DNINODES=...)
+#ifndef NINODES
 #define NINODES 200
+#endif
+#ifndef FSSIZE
 #define FSSIZE 1000
+#endif
 #define LOGSIZE 30
 
 int nbitmap = FSSIZE / (BSIZE * 8) + 1;
@@ -23,7 +29,16 @@ int fsfd;
 struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
-uint freeblock;
+uint freeblock;  // Next block of the file zone
+uint dirblock;   // Next block of the directory zone
+uint dirend;     // End of the directory zone
+uchar usedmap[FSSIZE / 8 + 1];  // Data blocks handed out
+
+// A run of blocks set aside for one file, [next, end)
+struct reservation {
+    uint next;
+    uint end;
+} resv[NINODES];
 
 void wsect(uint, void *);
 void winode(uint, struct dinode *);
@@ -31,7 +46,11 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
-void balloc(int used);
+void ireserve(uint inum, uint size);
+uint allocblock(uint inum, int type);
+uint idir(uint parent);
+void ilink(uint dir, uint inum, char *name);
+void balloc(void);
 ushort xshort(ushort x);
 uint xint(uint x);
 
@@ -80,6 +99,16 @@ int main(int argc, char *argv[]) {
             create_error = 12; // Bad reference count for file
         } else if (strcmp(argv[argc - 1], "error_directory_appears_more_than_once") == 0) {
             create_error = 13; // Directory appearing more than once in the file system
+        } else if (strcmp(argv[argc - 1], "error_parent_mismatch") == 0) {
+            create_error = 14; // Directory's ".." does not name the directory holding it
+        } else if (strcmp(argv[argc - 1], "error_dir_unreachable") == 0) {
+            create_error = 15; // Directory not reachable from the root
+        } else if (strcmp(argv[argc - 1], "error_dir_loop") == 0) {
+            create_error = 16; // Directory entry naming the root
+        } else if (strcmp(argv[argc - 1], "error_duplicate_name") == 0) {
+            create_error = 17; // Two entries with the same name in one directory
+        } else if (strcmp(argv[argc - 1], "error_dir_inode_zero") == 0) {
+            create_error = 18; // Inode 0 in use as a directory
         } else {
             fprintf(stderr, "Unknown error type: %s\n", argv[argc - 1]);
             exit(1);
@@ -111,7 +140,14 @@ int main(int argc, char *argv[]) {
     printf("nmeta %d (boot, super, log %u inode %u, bitmap %u) blocks %d total %d\n",
            nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
 
-    freeblock = nmeta;     // the first free block that we can allocate
+    // Directory blocks are grouped in a zone right after the inodes and
+    // bitmap, sized for the root's entries (two per file at most, plus
+    // the ones the error modes add) and one block each for the two other
+    // directories an error mode may add. File data follows the zone.
+    uint root_entries = 2 + 2 * (file_end - file_start) + 8;
+    dirblock = nmeta;
+    dirend = dirblock + (root_entries * sizeof(struct dirent) + BSIZE - 1) / BSIZE + 2;
+    freeblock = dirend;    // the first free block that we can allocate
 
     for (i = 0; i < FSSIZE; i++) {
         wsect(i, zeroes);
@@ -124,7 +160,7 @@ int main(int argc, char *argv[]) {
     if (create_error == 4) { // Missing root directory
         // Simulate missing root directory by not allocating or initializing it
         printf("Creating a filesystem with missing root directory.\n");
-        balloc(freeblock);
+        balloc();
         close(fsfd);
         return 0;
     }
@@ -180,7 +216,10 @@ int main(int argc, char *argv[]) {
         }
         winode(inum, &din);
 
-        // Write file content
+        // Write file content into one run sized from its length
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+            ireserve(inum, st.st_size);
         while ((cc = read(fd, buf, sizeof(buf))) > 0)
             iappend(inum, buf, cc);
 
@@ -196,10 +235,12 @@ int main(int argc, char *argv[]) {
         if (create_error == 8) {
             // Direct address used more than once
             // We'll duplicate a direct address in another inode
+            rinode(inum, &din);
+            uint shared = din.addrs[0];
             uint inum2 = ialloc(T_FILE);
             rinode(inum2, &din);
             din.nlink = xshort(1);
-            din.addrs[0] = xint(freeblock - 1); // Use the same block as previous inode
+            din.addrs[0] = shared; // Use the same block as previous inode
             winode(inum2, &din);
             // Create directory entry
             bzero(&de, sizeof(de));
@@ -298,42 +339,68 @@ int main(int argc, char *argv[]) {
         winode(inum2, &din);
     }
 
-    // Fix size of root inode dir
-    rinode(rootino, &din);
-    off = xint(din.size);
-    off = ((off / BSIZE) + 1) * BSIZE;
-    din.size = xint(off);
-    winode(rootino, &din);
+    if (create_error == 14) {
+        // Directory whose ".." names another directory than its parent
+        printf("Creating a filesystem with a parent directory mismatch.\n");
+        uint dir_a = idir(rootino);
+        ilink(rootino, dir_a, "dir_a");
+        // Named in the root, but claims dir_a as its parent
+        uint dir_b = idir(dir_a);
+        ilink(rootino, dir_b, "dir_b");
+    }
 
+    if (create_error == 15) {
+        // Directory no entry leads to
+        printf("Creating a filesystem with a directory not reachable from the root.\n");
+        idir(rootino);
+    }
+
+    if (create_error == 16) {
+        // Subdirectory with an entry naming the root
+        printf("Creating a filesystem with a directory loop.\n");
+        uint dir = idir(rootino);
+        ilink(rootino, dir, "dir");
+        ilink(dir, rootino, "up");
+    }
+
+    if (create_error == 17) {
+        // Two files under one name in the root
+        printf("Creating a filesystem with a name appearing twice in a directory.\n");
+        ilink(rootino, ialloc(T_FILE), "dup_name");
+        ilink(rootino, ialloc(T_FILE), "dup_name");
+    }
+
+    if (create_error == 18) {
+        // Inode 0, which no entry can name, made a directory with one entry
+        printf("Creating a filesystem with inode 0 in use as a directory.\n");
+        rinode(0, &din);
+        din.type = xshort(T_DIR);
+        din.nlink = xshort(1);
+        winode(0, &din);
+        ilink(0, rootino, "x");
+    }
 
+    uint free_addr = 0;
     if (create_error == 6) {
-        // Address used by inode but marked free in bitmap
+        // Address used by inode but marked free in bitmap: a one-block
+        // file linked once, whose bit is cleared after balloc()
         printf("Creating a filesystem with address used by inode but marked free in bitmap.\n");
-
-        // Allocate a new inode for testing
         inum = ialloc(T_FILE);
-
-        // Allocate a data block for this inode and update inode's direct address
+        free_addr = allocblock(inum, T_FILE);
         rinode(inum, &din);
-        din.addrs[0] = xint(freeblock++);  // Assign a block number to inode
-        din.size = xint(BSIZE); // Set a size to indicate it uses one block
+        din.addrs[0] = xint(free_addr);
+        din.size = xint(BSIZE);
         winode(inum, &din);
+        ilink(rootino, inum, "file_with_free_block");
+    }
 
-        // Reference the inode in the root directory
-        bzero(&de, sizeof(de));
-        de.inum = xshort(inum);
-        strncpy(de.name, "file_with_free_block", DIRSIZ);
-        iappend(rootino, &de, sizeof(de));
+    // Fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off / BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
 
-        // Mark this block as free in the bitmap
-        uint addr = xint(din.addrs[0]);
-        uchar bitmap_buf[BSIZE];
-        uint bmap_block = xint(sb.bmapstart) + (addr / BPB);
-        rsect(bmap_block, bitmap_buf);
-        uint block_offset = addr % BPB;
-        bitmap_buf[block_offset / 8] &= ~(1 << (block_offset % 8));  // Mark as free
-        wsect(bmap_block, bitmap_buf);
-    }
 
     if (create_error == 11) {
         // Inode referred to in directory but marked free
@@ -345,7 +412,7 @@ int main(int argc, char *argv[]) {
         iappend(rootino, &de, sizeof(de));
     }
 
-    balloc(freeblock);
+    balloc();
     if (create_error == 7) {
         // Bitmap marks block in use but it is not in use
         printf("Creating a filesystem with bitmap marking block in use but not in use.\n");
@@ -362,30 +429,11 @@ int main(int argc, char *argv[]) {
 
 
     if (create_error == 6) {
-        // Address used by inode but marked free in bitmap
-        printf("Creating a filesystem with address used by inode but marked free in bitmap.\n");
-
-        // Allocate a new inode for testing
-        inum = ialloc(T_FILE);
-
-        // Allocate a data block for this inode and update inode's direct address
-        rinode(inum, &din);
-        din.addrs[0] = xint(freeblock++);  // Assign a block number to inode
-        din.size = xint(BSIZE); // Set a size to indicate it uses one block
-        winode(inum, &din);
-
-        // Reference the inode in the root directory
-        bzero(&de, sizeof(de));
-        de.inum = xshort(inum);
-        strncpy(de.name, "file_with_free_block", DIRSIZ);
-        iappend(rootino, &de, sizeof(de));
-
-        // Mark this block as free in the bitmap
-        uint addr = xint(din.addrs[0]);
+        // Clear the bit of the block allocated for this file
         uchar bitmap_buf[BSIZE];
-        uint bmap_block = xint(sb.bmapstart) + (addr / BPB);
+        uint bmap_block = xint(sb.bmapstart) + (free_addr / BPB);
         rsect(bmap_block, bitmap_buf);
-        uint block_offset = addr % BPB;
+        uint block_offset = free_addr % BPB;
         bitmap_buf[block_offset / 8] &= ~(1 << (block_offset % 8));  // Mark as free
         wsect(bmap_block, bitmap_buf);
     }
@@ -469,6 +517,7 @@ void iappend(uint inum, void *xp, int n) {
 
     rinode(inum, &din);
     off = xint(din.size);
+    int type = xshort(din.type);
 
     while (n > 0) {
         fbn = off / BSIZE;
@@ -476,16 +525,18 @@ void iappend(uint inum, void *xp, int n) {
 
         if (fbn < NDIRECT) {
             if (xint(din.addrs[fbn]) == 0) {
-                din.addrs[fbn] = xint(freeblock++);
+                din.addrs[fbn] = xint(allocblock(inum, type));
             }
             x = xint(din.addrs[fbn]);
         } else {
             if (xint(din.addrs[NDIRECT]) == 0) {
-                din.addrs[NDIRECT] = xint(freeblock++);
+                // Taken from the same run, so it sits between the
+                // direct blocks and the data it maps
+                din.addrs[NDIRECT] = xint(allocblock(inum, type));
             }
             rsect(xint(din.addrs[NDIRECT]), (char *)indirect);
             if (xint(indirect[fbn - NDIRECT]) == 0) {
-                indirect[fbn - NDIRECT] = xint(freeblock++);
+                indirect[fbn - NDIRECT] = xint(allocblock(inum, type));
                 wsect(xint(din.addrs[NDIRECT]), (char *)indirect);
             }
             x = xint(indirect[fbn - NDIRECT]);
@@ -504,23 +555,83 @@ void iappend(uint inum, void *xp, int n) {
     winode(inum, &din);
 }
 
-void balloc(int used) {
-    uchar buf[BSIZE];
-    int i;
+// Set aside a contiguous run for a file of size bytes: its data
+// blocks, and its indirect block if it needs one.
+void ireserve(uint inum, uint size) {
+    uint n = (size + BSIZE - 1) / BSIZE;
+
+    if (n > NDIRECT)
+        n++;
+    assert(freeblock + n <= FSSIZE);
+    resv[inum].next = freeblock;
+    resv[inum].end = freeblock + n;
+    freeblock += n;
+}
+
+// Allocate the next block of inode inum: from its reservation while it
+// lasts, from the directory zone for a directory, otherwise from the
+// file zone.
+uint allocblock(uint inum, int type) {
+    uint b;
+
+    if (resv[inum].next < resv[inum].end)
+        b = resv[inum].next++;
+    else if (type == T_DIR && dirblock < dirend)
+        b = dirblock++;
+    else
+        b = freeblock++;
+    assert(b < FSSIZE);
+    usedmap[b / 8] |= 1 << (b % 8);
+    return b;
+}
 
-    printf("balloc: first %d blocks have been allocated\n", used);
-    assert(used < FSSIZE);
+// Allocate a directory holding "." and "..", the latter naming parent
+uint idir(uint parent) {
+    struct dirent de;
+    uint inum = ialloc(T_DIR);
+
+    bzero(&de, sizeof(de));
+    de.inum = xshort(inum);
+    strcpy(de.name, ".");
+    iappend(inum, &de, sizeof(de));
+
+    bzero(&de, sizeof(de));
+    de.inum = xshort(parent);
+    strcpy(de.name, "..");
+    iappend(inum, &de, sizeof(de));
+    return inum;
+}
+
+// Add an entry naming inum to directory dir
+void ilink(uint dir, uint inum, char *name) {
+    struct dirent de;
+
+    bzero(&de, sizeof(de));
+    de.inum = xshort(inum);
+    strncpy(de.name, name, DIRSIZ);
+    iappend(dir, &de, sizeof(de));
+}
+
+// Write the bitmap: the metadata blocks and every block allocated
+void balloc(void) {
+    uchar buf[BSIZE];
+    int i, used = 0;
 
     int blocks = FSSIZE;
     int bmap_blocks = (blocks + BPB - 1) / BPB;
 
     for (int b = 0; b < bmap_blocks; b++) {
         bzero(buf, BSIZE);
-        for (i = 0; i < BPB && (b * BPB + i) < used; i++) {
-            buf[i / 8] |= (0x1 << (i % 8));
+        for (i = 0; i < BPB && (b * BPB + i) < blocks; i++) {
+            int bno = b * BPB + i;
+            if (bno < nmeta || (usedmap[bno / 8] >> (bno % 8)) & 1) {
+                buf[i / 8] |= (0x1 << (i % 8));
+                used++;
+            }
         }
         wsect(xint(sb.bmapstart) + b, buf);
     }
+    printf("balloc: %d blocks have been allocated\n", used);
 }
 
 ushort xshort(ushort x) {